@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include "../common/common.h"
 
 #define COLOR_BACKGROUND FB_COLOR(0x0, 0x0, 0x0)
@@ -12,7 +13,22 @@
 #define PLUS_X 10
 #define MINUS_X 60
 #define RESET_X 110
+#define ROTATE_X 160
+#define GALLERY_X 210
 #define EXIT_X 670
+#define VIEW_H (SCREEN_HEIGHT - BAR_H)
+#define PREFETCH_RANGE 2                  // 浏览目录时当前图片前后各预取几张
+#define PREFETCH_BYTES (16 * 1024 * 1024) // 预取图片占用的内存上限
+#define FIT_BYTES (SCREEN_WIDTH * VIEW_H * 4) // 一张适合屏幕大小的图片最多占用的内存
+#define SWIPE_MIN 120                     // 横向滑动超过这个距离才切换图片
+#define TAP_MAX 10                        // 按下到抬起移动不超过这个距离算点击
+#define GALLERY_COLS 4                    // 缩略图网格的列数
+#define CELL_W (SCREEN_WIDTH / GALLERY_COLS)
+#define CELL_H 140
+#define THUMB_W 160
+#define THUMB_H 120
+#define THUMB_KEEP (2 * VIEW_H)           // 离可见区域超过这个距离的缩略图被释放
+#define THUMB_DIR "/home/pi/.thumbs"      // 缩略图缓存目录
 #define IN_SQUARE(x, y, sx, sy, size) ((x >= sx) && (x < sx + size) && (y >= sy) && (y < sy + size))
 
 enum image_type
@@ -26,21 +42,55 @@ static int touch_fd;
 static fb_image *minus_img;
 static fb_image *plus_img;
 static fb_image *reset_img;
+static fb_image *rotate_img;
+static fb_image *gallery_img;
+static fb_layer *toolbar; // 工具栏图层, 内容不变, 不用每次重画
 static fb_image *exit_img;
-static fb_image *show_img;
+static fb_image *show_img; // 当前缩放级别用来缩放的源, 属于金字塔
+static int show_scale;     // show_img画到屏幕上的缩放倍数(16.16定点数)
 static fb_image *src_img;
+static fb_pyramid *src_pyramid; // src_img的各级缩小版本
+static fb_image *orig_img;       // 当前图片未旋转的版本
+static fb_image *rotated_img;    // 旋转后的图片, 由查看器自己释放
+static int rotation = 0;         // 顺时针转过了几个90度
 static enum image_type img_type;
 static char *filepath;
 static int loc_x, loc_y;           // 图片定位
 static int old_x, old_y, drag = 0; // old_x old_y - 坐标旧值, drag - 是否拖动标记
 static int scale_level = 0; // 缩放尺度，负数代表缩小，正数代表放大
-void draw_ui() // draw clear button, background and refresh screen
+static int press_x, press_y; // 按下时的坐标, 用来判断滑动和点击
+
+enum slot_state
+{
+    SLOT_EMPTY,
+    SLOT_LOADING,
+    SLOT_READY,
+    SLOT_FAILED
+};
+typedef struct
+{
+    fb_image *img; // 缩放到适合屏幕大小的图片, 由后台线程解码
+    enum slot_state state;
+} browse_slot;
+static char **browse_files; // 浏览目录时目录下所有的图片
+static browse_slot *browse_slots;
+static int browse_num = 0, browse_cur = 0;
+static int browse_bytes = 0; // 已加载和正在加载的图片占用的内存
+static browse_slot *thumb_slots; // 缩略图, 和browse_files一一对应
+static int gallery = 0;          // 是否在缩略图网格模式
+static int gallery_y = 0;        // 网格滚动到的位置
+void draw_ui() // 往初始化时建好的工具栏图层里画, 之后由fb_update按需合成
 {
-    fb_draw_rect(0, 0, SCREEN_WIDTH, BAR_H, COLOR_BAR);
-    fb_draw_image(PLUS_X, MARGIN, plus_img, 0);
-    fb_draw_image(MINUS_X, MARGIN, minus_img, 0);
-    fb_draw_image(RESET_X, MARGIN, reset_img, 0);
-    fb_draw_image(EXIT_X, MARGIN, exit_img, 0);
+    fb_layer_fill_rect(toolbar, 0, 0, SCREEN_WIDTH, BAR_H, COLOR_BAR);
+    fb_layer_draw_image(toolbar, PLUS_X, MARGIN, plus_img, 0);
+    fb_layer_draw_image(toolbar, MINUS_X, MARGIN, minus_img, 0);
+    fb_layer_draw_image(toolbar, RESET_X, MARGIN, reset_img, 0);
+    fb_layer_draw_image(toolbar, ROTATE_X, MARGIN, rotate_img, 0);
+    if (browse_num > 0)
+    {
+        fb_layer_draw_image(toolbar, GALLERY_X, MARGIN, gallery_img, 0);
+    }
+    fb_layer_draw_image(toolbar, EXIT_X, MARGIN, exit_img, 0);
 }
 enum image_type get_image_type(const char *path)
 {
@@ -49,9 +99,10 @@ enum image_type get_image_type(const char *path)
     {
         return insupport;
     }
-    char png_type[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
-    char file_head[8];
+    unsigned char png_type[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+    unsigned char file_head[8] = {0};
     read(fd, file_head, 8);
+    close(fd);
     switch (file_head[0])
     {
     case 0xff:
@@ -65,108 +116,544 @@ enum image_type get_image_type(const char *path)
         return insupport;
     }
 }
-void clear_draw()
+void clear_draw() // 只清工具栏下方的图片区域
 {
-    fb_draw_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, COLOR_BACKGROUND);
+    fb_draw_rect(0, BAR_H, SCREEN_WIDTH, VIEW_H, COLOR_BACKGROUND);
 }
-fb_image *fb_read_image(char *file, enum image_type type)
+void draw_image() // 直接缩放画到屏幕上, 只计算工具栏下方可见的部分
 {
-    switch (type)
+    fb_rect view = {0, BAR_H, SCREEN_WIDTH, SCREEN_HEIGHT - BAR_H};
+    fb_draw_image_scaled(loc_x, loc_y, show_img, NULL, show_scale, &view);
+}
+void scroll_image(int dx, int dy) // 已画好的部分整体平移, 只重画新露出的条带
+{
+    fb_rect view = {0, BAR_H, SCREEN_WIDTH, SCREEN_HEIGHT - BAR_H};
+    fb_rect exposed[2];
+    int n = fb_scroll_area(&view, dx, dy, exposed);
+    for (int i = 0; i < n; i++)
     {
-    case jpg:
-        return fb_read_jpeg_image(file);
-    case png:
-        return fb_read_png_image(file);
-    default:
-        return NULL;
+        fb_draw_rect(exposed[i].x, exposed[i].y, exposed[i].w, exposed[i].h, COLOR_BACKGROUND);
+        fb_draw_image_scaled(loc_x, loc_y, show_img, NULL, show_scale, &exposed[i]);
     }
 }
-static void touch_event_cb(int fd)
+int zoom_src_image(int level) // 缩小用金字塔中对应的一层, 放大直接从原图缩放
+{
+    fb_image *img = src_img;
+    if ((img == NULL) || (level > 8))
+    {
+        return -1;
+    }
+    if ((level < 0) && ((img = fb_pyramid_level(src_pyramid, -level)) == NULL))
+    {
+        return -1;
+    }
+    show_img = img;
+    show_scale = (level > 0) ? (FB_SCALE_ONE << level) : FB_SCALE_ONE;
+    return 0;
+}
+void reset_location() // 图片都已缩小到不超过可见区域, 居中显示
+{
+    loc_x = 0;
+    loc_y = BAR_H;
+    if (src_img != NULL)
+    {
+        loc_x = (SCREEN_WIDTH - src_img->pixel_w) / 2;
+        loc_y = BAR_H + (VIEW_H - src_img->pixel_h) / 2;
+    }
+}
+void use_image(fb_image *img)
+{
+    fb_pyramid_free(src_pyramid);
+    src_img = img;
+    src_pyramid = fb_pyramid_new(img);
+    show_img = NULL;
+    scale_level = 0;
+    if (img != NULL)
+    {
+        zoom_src_image(0);
+    }
+    reset_location();
+}
+void set_src_image(fb_image *img) // 换一张源图片, img为NULL时不显示图片
+{
+    use_image(img);
+    fb_free_image(rotated_img);
+    rotated_img = NULL;
+    orig_img = img;
+    rotation = 0;
+}
+void rotate_src_image() // 每次都从未旋转的版本转, 多次旋转不会累积误差和内存
 {
-    int type, x, y, finger;
-    type = touch_read(fd, &x, &y, &finger);
-    if (finger != 0)
+    static const int orients[4] = {FB_ORIENT_NORMAL, FB_ORIENT_ROT_90, FB_ORIENT_ROT_180, FB_ORIENT_ROT_270};
+    int r = (rotation + 1) % 4;
+    fb_image *img = orig_img;
+    if ((orig_img == NULL) || ((r != 0) && ((img = fb_rotate_image(orig_img, orients[r])) == NULL)))
     {
         return;
     }
-    fb_image *new_img = NULL;
-    switch (type)
+    use_image(img);
+    fb_free_image(rotated_img);
+    rotated_img = (r != 0) ? img : NULL;
+    rotation = r;
+}
+
+static fb_image *single_img; // 后台线程解码出的单个文件, single_done之前主线程不碰它
+static void single_work(int index, void *arg) // 单个文件也只解码成屏幕大小, 原图再大也不整张留在内存里
+{
+    (void)index;
+    (void)arg;
+    single_img = fb_load_image_fit(filepath, SCREEN_WIDTH, VIEW_H);
+}
+static void single_done(int index, void *arg)
+{
+    (void)index;
+    (void)arg;
+    if (single_img == NULL)
     {
-    case TOUCH_PRESS:
-        if (IN_SQUARE(x, y, PLUS_X, MARGIN, ICON_SIZE)) // 放大
+        fprintf(stderr, "cannot decode image: %s\n", filepath);
+        exit(1);
+    }
+    set_src_image(single_img);
+    clear_draw();
+    draw_image();
+    fb_update();
+}
+
+int browse_distance(int index) // 和当前图片相隔几张, 首尾相连
+{
+    int d = abs(index - __atomic_load_n(&browse_cur, __ATOMIC_RELAXED));
+    return (d < browse_num - d) ? d : browse_num - d;
+}
+void browse_prefetch();
+static void prefetch_work(int index, void *arg)
+{
+    (void)arg;
+    if (browse_distance(index) <= PREFETCH_RANGE) // 已经翻走了就不再解码
+    {
+        browse_slots[index].img = fb_load_image_fit(browse_files[index], SCREEN_WIDTH, VIEW_H);
+    }
+}
+static void prefetch_done(int index, void *arg)
+{
+    (void)arg;
+    browse_slot *slot = &browse_slots[index];
+    browse_bytes -= FIT_BYTES;
+    if (slot->img != NULL)
+    {
+        slot->state = SLOT_READY;
+        browse_bytes += slot->img->line_byte * slot->img->pixel_h;
+    }
+    else
+    {
+        slot->state = (browse_distance(index) <= PREFETCH_RANGE) ? SLOT_FAILED : SLOT_EMPTY;
+    }
+    if ((index == browse_cur) && (slot->state == SLOT_READY) && (src_img == NULL)) // 正在等这张
+    {
+        set_src_image(slot->img);
+        if (!gallery)
         {
-            if ((new_img = zoom_image(src_img, ++scale_level)) != NULL)
+            clear_draw();
+            draw_image();
+            fb_update();
+        }
+    }
+    browse_prefetch();
+}
+void browse_prefetch() // 释放离当前图片太远的, 再由近到远预取, 当前图片总是加载
+{
+    for (int i = 0; i < browse_num; i++)
+    {
+        browse_slot *slot = &browse_slots[i];
+        if ((slot->state == SLOT_READY) && (browse_distance(i) > PREFETCH_RANGE))
+        {
+            browse_bytes -= slot->img->line_byte * slot->img->pixel_h;
+            fb_free_image(slot->img);
+            slot->img = NULL;
+            slot->state = SLOT_EMPTY;
+        }
+    }
+    for (int d = 0; d <= PREFETCH_RANGE; d++)
+    {
+        for (int sign = 1; sign >= -1; sign -= 2)
+        {
+            int i = ((browse_cur + sign * d) % browse_num + browse_num) % browse_num;
+            browse_slot *slot = &browse_slots[i];
+            if (slot->state != SLOT_EMPTY)
+            {
+                continue;
+            }
+            if ((d > 0) && (browse_bytes + FIT_BYTES > PREFETCH_BYTES))
+            {
+                return;
+            }
+            slot->state = SLOT_LOADING;
+            browse_bytes += FIT_BYTES;
+            if (task_post(prefetch_work, prefetch_done, i, NULL) < 0)
+            {
+                slot->state = SLOT_EMPTY;
+                browse_bytes -= FIT_BYTES;
+                return;
+            }
+        }
+    }
+}
+void browse_show(int index) // 切换到第index张, 还没解码完时先空着, 解码完成后再画
+{
+    __atomic_store_n(&browse_cur, (index % browse_num + browse_num) % browse_num, __ATOMIC_RELAXED);
+    browse_slot *slot = &browse_slots[browse_cur];
+    set_src_image((slot->state == SLOT_READY) ? slot->img : NULL);
+    browse_prefetch();
+    clear_draw();
+    draw_image();
+    fb_update();
+}
+int browse_open(const char *dir) // 列出目录下所有支持的图片, 按文件名排序
+{
+    struct dirent **list;
+    int n = scandir(dir, &list, NULL, alphasort);
+    if (n < 0)
+    {
+        return -1;
+    }
+    browse_files = (char **)malloc(n * sizeof(char *));
+    for (int i = 0; i < n; i++)
+    {
+        char *path = (char *)malloc(strlen(dir) + strlen(list[i]->d_name) + 2);
+        sprintf(path, "%s/%s", dir, list[i]->d_name);
+        if ((list[i]->d_type != DT_DIR) && (get_image_type(path) != insupport))
+        {
+            browse_files[browse_num++] = path;
+        }
+        else
+        {
+            free(path);
+        }
+        free(list[i]);
+    }
+    free(list);
+    browse_slots = (browse_slot *)calloc(browse_num + 1, sizeof(browse_slot));
+    thumb_slots = (browse_slot *)calloc(browse_num + 1, sizeof(browse_slot));
+    return browse_num;
+}
+int thumb_distance(int index) // 缩略图所在行离可见区域有多远, 可见时为0
+{
+    int top = (index / GALLERY_COLS) * CELL_H - __atomic_load_n(&gallery_y, __ATOMIC_RELAXED);
+    if (top + CELL_H <= 0)
+    {
+        return -top - CELL_H + 1;
+    }
+    return (top >= VIEW_H) ? top - VIEW_H + 1 : 0;
+}
+void draw_thumb(int index, const fb_rect *clip) // 只画clip内的部分, 还没加载好时画灰色方块
+{
+    int x = (index % GALLERY_COLS) * CELL_W;
+    int y = BAR_H + (index / GALLERY_COLS) * CELL_H - gallery_y;
+    fb_image *img = thumb_slots[index].img;
+    if (thumb_slots[index].state == SLOT_READY)
+    {
+        fb_draw_image_scaled(x + (CELL_W - img->pixel_w) / 2, y + (CELL_H - img->pixel_h) / 2, img, NULL, FB_SCALE_ONE, clip);
+        return;
+    }
+    int x1 = x + (CELL_W - THUMB_W) / 2, y1 = y + (CELL_H - THUMB_H) / 2;
+    int x2 = x1 + THUMB_W, y2 = y1 + THUMB_H;
+    x1 = (x1 > clip->x) ? x1 : clip->x;
+    y1 = (y1 > clip->y) ? y1 : clip->y;
+    x2 = (x2 < clip->x + clip->w) ? x2 : clip->x + clip->w;
+    y2 = (y2 < clip->y + clip->h) ? y2 : clip->y + clip->h;
+    if ((x2 > x1) && (y2 > y1))
+    {
+        fb_draw_rect(x1, y1, x2 - x1, y2 - y1, COLOR_GREY);
+    }
+}
+void draw_gallery(const fb_rect *clip) // 重画clip内的网格, 只涉及和clip相交的格子
+{
+    fb_draw_rect(clip->x, clip->y, clip->w, clip->h, COLOR_BACKGROUND);
+    int first = (clip->y - BAR_H + gallery_y) / CELL_H;
+    int last = (clip->y + clip->h - 1 - BAR_H + gallery_y) / CELL_H;
+    for (int row = first; row <= last; row++)
+    {
+        for (int col = 0; col < GALLERY_COLS; col++)
+        {
+            int i = row * GALLERY_COLS + col;
+            if ((i >= 0) && (i < browse_num))
             {
-                fb_free_image(show_img);
-                show_img = new_img;
-                clear_draw();
-                fb_draw_image(loc_x, loc_y, show_img, 0);
-                draw_ui();
+                draw_thumb(i, clip);
             }
         }
-        else if (IN_SQUARE(x, y, MINUS_X, MARGIN, ICON_SIZE)) // 缩小
+    }
+}
+void gallery_load();
+static void thumb_work(int index, void *arg)
+{
+    (void)arg;
+    if (thumb_distance(index) <= CELL_H) // 已经滚走了就不再生成
+    {
+        thumb_slots[index].img = fb_thumb_acquire(browse_files[index], THUMB_W, THUMB_H, THUMB_DIR);
+    }
+}
+static void thumb_done(int index, void *arg)
+{
+    (void)arg;
+    browse_slot *slot = &thumb_slots[index];
+    if (slot->img != NULL)
+    {
+        slot->state = SLOT_READY;
+    }
+    else
+    {
+        slot->state = (thumb_distance(index) <= CELL_H) ? SLOT_FAILED : SLOT_EMPTY;
+    }
+    if (gallery && (slot->state == SLOT_READY) && (thumb_distance(index) == 0))
+    {
+        fb_rect cell = {(index % GALLERY_COLS) * CELL_W, BAR_H + (index / GALLERY_COLS) * CELL_H - gallery_y, CELL_W, CELL_H};
+        if (cell.y < BAR_H) // 不能画到工具栏上
+        {
+            cell.h -= BAR_H - cell.y;
+            cell.y = BAR_H;
+        }
+        draw_gallery(&cell);
+        fb_update();
+    }
+}
+static int thumb_lo = 0, thumb_hi = -1; // 已加载或正在加载的缩略图都在这个下标范围内
+void gallery_load() // 释放滚出很远的缩略图, 给可见的和上下各一行的缩略图排队生成, 不遍历全部格子
+{
+    int lo = browse_num, hi = -1;
+    for (int i = thumb_lo; i <= thumb_hi; i++)
+    {
+        browse_slot *slot = &thumb_slots[i];
+        if ((slot->state == SLOT_READY) && (thumb_distance(i) > THUMB_KEEP))
         {
-            if ((new_img = zoom_image(src_img, --scale_level)) != NULL)
+            fb_thumb_release(slot->img);
+            slot->img = NULL;
+            slot->state = SLOT_EMPTY;
+        }
+        if ((slot->state == SLOT_READY) || (slot->state == SLOT_LOADING))
+        {
+            lo = (i < lo) ? i : lo;
+            hi = (i > hi) ? i : hi;
+        }
+    }
+    int first = gallery_y / CELL_H - 2; // 离可见区域不超过CELL_H的行都在first~last之间
+    int last = (gallery_y + VIEW_H) / CELL_H + 1;
+    first = (first < 0) ? 0 : first;
+    for (int i = first * GALLERY_COLS; (i < (last + 1) * GALLERY_COLS) && (i < browse_num); i++)
+    {
+        browse_slot *slot = &thumb_slots[i];
+        if ((slot->state == SLOT_EMPTY) && (thumb_distance(i) <= CELL_H))
+        {
+            slot->state = SLOT_LOADING;
+            if (task_post(thumb_work, thumb_done, i, NULL) < 0)
             {
-                fb_free_image(show_img);
-                show_img = new_img;
-                clear_draw();
-                fb_draw_image(loc_x, loc_y, show_img, 0);
-                draw_ui();
+                slot->state = SLOT_EMPTY;
             }
         }
-        else if (IN_SQUARE(x, y, RESET_X, MARGIN, ICON_SIZE)) // 重置图片大小
+        if ((slot->state == SLOT_READY) || (slot->state == SLOT_LOADING))
         {
-            loc_x = 0;
-            loc_y = BAR_H;
-            fb_free_image(show_img);
-            show_img = fb_copy_image(src_img);
+            lo = (i < lo) ? i : lo;
+            hi = (i > hi) ? i : hi;
+        }
+    }
+    thumb_lo = lo;
+    thumb_hi = hi;
+}
+int gallery_max_y() // 网格最多能滚动到的位置
+{
+    int rows = (browse_num + GALLERY_COLS - 1) / GALLERY_COLS;
+    return (rows * CELL_H > VIEW_H) ? rows * CELL_H - VIEW_H : 0;
+}
+void gallery_show() // 进入网格模式, 当前图片所在的行放在最上面
+{
+    int max_y = gallery_max_y();
+    int y = (browse_cur / GALLERY_COLS) * CELL_H;
+    fb_rect view = {0, BAR_H, SCREEN_WIDTH, VIEW_H};
+    gallery = 1;
+    __atomic_store_n(&gallery_y, (y < max_y) ? y : max_y, __ATOMIC_RELAXED);
+    draw_gallery(&view);
+    gallery_load();
+}
+void gallery_scroll(int dy) // 网格整体平移, 只画新露出的条带
+{
+    int max_y = gallery_max_y();
+    int y = gallery_y - dy;
+    y = (y > max_y) ? max_y : y;
+    y = (y < 0) ? 0 : y;
+    if (y == gallery_y)
+    {
+        return;
+    }
+    fb_rect view = {0, BAR_H, SCREEN_WIDTH, VIEW_H};
+    fb_rect exposed[2];
+    int n = fb_scroll_area(&view, 0, gallery_y - y, exposed);
+    __atomic_store_n(&gallery_y, y, __ATOMIC_RELAXED);
+    for (int i = 0; i < n; i++)
+    {
+        draw_gallery(&exposed[i]);
+    }
+    gallery_load();
+}
+void gallery_open(int x, int y) // 点击缩略图, 切换到浏览这一张
+{
+    int i = ((y - BAR_H + gallery_y) / CELL_H) * GALLERY_COLS + x / CELL_W;
+    if ((i >= 0) && (i < browse_num))
+    {
+        gallery = 0;
+        browse_show(i);
+    }
+}
+void release_images()
+{
+    fb_image_release(plus_img);
+    fb_image_release(minus_img);
+    fb_image_release(reset_img);
+    fb_image_release(rotate_img);
+    fb_image_release(gallery_img);
+    fb_image_release(exit_img);
+    fb_pyramid_free(src_pyramid);
+    fb_free_image(rotated_img);
+    fb_layer_free(toolbar);
+    if (browse_num == 0)
+    {
+        fb_free_image(orig_img);
+    }
+    for (int i = 0; i < browse_num; i++) // 正在后台解码的不动
+    {
+        if (browse_slots[i].state == SLOT_READY)
+        {
+            fb_free_image(browse_slots[i].img);
+        }
+        if (thumb_slots[i].state == SLOT_READY)
+        {
+            fb_thumb_release(thumb_slots[i].img);
+        }
+    }
+}
+
+void press_button(int x, int y) // 放大、缩小、重置、旋转
+{
+    if (IN_SQUARE(x, y, PLUS_X, MARGIN, ICON_SIZE)) // 放大
+    {
+        if (zoom_src_image(scale_level + 1) == 0)
+        {
+            scale_level++;
             clear_draw();
-            fb_draw_image(loc_x, loc_y, show_img, 0);
-            draw_ui();
+            draw_image();
         }
-        else if (IN_SQUARE(x, y, EXIT_X, MARGIN, ICON_SIZE)) // 离开
+    }
+    else if (IN_SQUARE(x, y, MINUS_X, MARGIN, ICON_SIZE)) // 缩小
+    {
+        if (zoom_src_image(scale_level - 1) == 0)
         {
+            scale_level--;
             clear_draw();
+            draw_image();
+        }
+    }
+    else if (IN_SQUARE(x, y, RESET_X, MARGIN, ICON_SIZE)) // 重置图片大小
+    {
+        reset_location();
+        if (zoom_src_image(0) == 0)
+        {
+            scale_level = 0;
+        }
+        clear_draw();
+        draw_image();
+    }
+    else if (IN_SQUARE(x, y, ROTATE_X, MARGIN, ICON_SIZE)) // 顺时针旋转90度
+    {
+        rotate_src_image();
+        clear_draw();
+        draw_image();
+    }
+}
+static void touch_finger(int type, int x, int y)
+{
+    switch (type)
+    {
+    case TOUCH_PRESS:
+        if (IN_SQUARE(x, y, EXIT_X, MARGIN, ICON_SIZE)) // 离开
+        {
+            fb_draw_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, COLOR_BACKGROUND);
             fb_update();
-            fb_free_image(plus_img);
-            fb_free_image(minus_img);
-            fb_free_image(reset_img);
-            fb_free_image(exit_img);
-            fb_free_image(show_img);
+            release_images();
             exit(0);
         }
+        else if ((browse_num > 0) && IN_SQUARE(x, y, GALLERY_X, MARGIN, ICON_SIZE)) // 切换网格/单张
+        {
+            if (gallery)
+            {
+                gallery = 0;
+                browse_show(browse_cur);
+            }
+            else
+            {
+                gallery_show();
+            }
+        }
         else if (y > BAR_H) // 开始拖动
         {
             drag = 1;
+            press_x = x;
+            press_y = y;
+        }
+        else if (!gallery) // 网格模式下其它按钮不起作用
+        {
+            press_button(x, y);
         }
         break;
     case TOUCH_MOVE:
-        if (drag == 1)
+        if ((drag == 1) && gallery)
+        {
+            gallery_scroll(y - old_y);
+        }
+        else if (drag == 1)
         {
             int dx = x - old_x, dy = y - old_y;
-            loc_x = (dx == 0) ? loc_x : (loc_x + dx);
-            loc_y = (dy == 0) ? loc_y : (loc_y + dy);
-            clear_draw();
-            fb_draw_image(loc_x, loc_y, show_img, 0);
-            draw_ui();
+            loc_x += dx;
+            loc_y += dy;
+            scroll_image(dx, dy);
         }
         break;
     case TOUCH_RELEASE:
+        if ((drag == 1) && gallery)
+        {
+            if ((abs(x - press_x) <= TAP_MAX) && (abs(y - press_y) <= TAP_MAX))
+            {
+                gallery_open(x, y);
+            }
+        }
+        else if ((drag == 1) && (browse_num > 0) && (scale_level == 0) && (abs(x - press_x) > SWIPE_MIN))
+        {
+            browse_show((x < press_x) ? browse_cur + 1 : browse_cur - 1); // 左滑下一张, 右滑上一张
+        }
         drag = 0;
         break;
-    case TOUCH_ERROR:
-        printf("close touch fd\n");
-        close(fd);
-        task_delete_file(fd);
-        break;
     default:
         return;
     }
     old_x = x;
     old_y = y;
+}
+
+static void touch_event_cb(int fd) // 只用第一个手指; 积压的移动合并成一次, 画面总是跟着最新位置
+{
+    touch_frame frame;
+    int n;
+    while ((n = touch_read_coalesced(fd, &frame, NULL)) > 0)
+    {
+        if (frame.changed & 1)
+        {
+            touch_finger(frame.slot[0].event, frame.slot[0].x, frame.slot[0].y);
+        }
+    }
+    if (n < 0)
+    {
+        printf("close touch fd\n");
+        task_delete_file(fd);
+        touch_close(fd);
+        return;
+    }
     fb_update();
-    return;
 }
 
 int main(int argc, char *argv[])
@@ -177,44 +664,78 @@ int main(int argc, char *argv[])
         return 0;
     }
     filepath = argv[1];
-    if ((img_type = get_image_type(filepath)) == insupport)
+    struct stat st;
+    int browse = (stat(filepath, &st) == 0) && S_ISDIR(st.st_mode); // 参数是目录时进入浏览模式
+    if (browse)
+    {
+        if (browse_open(filepath) <= 0)
+        {
+            fprintf(stderr, "no image in directory: %s\n", filepath);
+            exit(1);
+        }
+    }
+    else if ((img_type = get_image_type(filepath)) == insupport)
     {
         fprintf(stderr, "unsupported image type: ");
         fprintf(stderr, filepath);
         fprintf(stderr, "\n");
         exit(1);
     }
-    if ((src_img = fb_read_image(filepath, img_type)) == NULL)
+    // 源图片在后台线程上按屏幕大小解码, 同时字体和图标在工作线程上并行加载, 图标颜色少, 尽量用调色板格式
+    // 浏览目录时源图片由后台线程按需解码, 不在这里加载
+    int posted = !browse && (task_post(single_work, single_done, 0, NULL) == 0);
+    if (!browse && !posted)
     {
-        fprintf(stderr, "cannot find image: ");
-        fprintf(stderr, filepath);
-        fprintf(stderr, "\n");
-        exit(1);
+        single_work(0, NULL);
     }
-    show_img = fb_copy_image(src_img);
+    fb_asset assets[] = {
+        {FB_ASSET_FONT, "/home/pi/font.ttc", 0, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/plus40.png", FB_DECODE_PALETTE, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/minus40.png", FB_DECODE_PALETTE, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/reset40.png", FB_DECODE_PALETTE, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/rotate40.png", FB_DECODE_PALETTE, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/grid40.png", FB_DECODE_PALETTE, NULL},
+        {FB_ASSET_IMAGE, "/home/pi/exit40.png", FB_DECODE_PALETTE, NULL},
+    };
+    int asset_num = sizeof(assets) / sizeof(assets[0]);
+    fb_image_cache_mount(fb_bundle_open("/home/pi/assets.fbb")); // mkbundle生成的预解码图标
+    fb_load_assets(assets, asset_num, NULL);
+    plus_img = assets[1].image;
+    minus_img = assets[2].image;
+    reset_img = assets[3].image;
+    rotate_img = assets[4].image;
+    gallery_img = assets[5].image;
+    exit_img = assets[6].image;
     fb_init("/dev/fb0");
-    font_init("/home/pi/font.ttc");
-    plus_img = fb_read_png_image("/home/pi/plus40.png");
-    minus_img = fb_read_png_image("/home/pi/minus40.png");
-    reset_img = fb_read_png_image("/home/pi/reset40.png");
-    exit_img = fb_read_png_image("/home/pi/exit40.png");
-    loc_x = 0;
-    loc_y = BAR_H;
-    clear_draw();
-    fb_draw_image(loc_x, loc_y, show_img, 0);
+    toolbar = fb_layer_new("toolbar", SCREEN_WIDTH, BAR_H, 0); // 只建一次, 退出时释放
     draw_ui();
-    fb_update();
+    if (browse)
+    {
+        browse_show(0);
+    }
+    else if (!posted) // task_post失败时已经在这里解码完
+    {
+        single_done(0, NULL);
+    }
+    else
+    {
+        clear_draw(); // 解码完成后由single_done画上
+        fb_update();
+    }
 
     //打开多点触摸设备文件, 返回文件fd
     touch_fd = touch_init("/dev/input/event0");
+    //在输入线程里读触摸事件, 画得慢时也不丢; 线程起不来就直接读touch_fd
+    int ring_fd = touch_thread_start(touch_fd);
+    if (ring_fd >= 0)
+    {
+        touch_fd = ring_fd;
+    }
     //添加任务, 当touch_fd文件可读时, 会自动调用touch_event_cb函数
     task_add_file(touch_fd, touch_event_cb);
 
     task_loop(); //进入任务循环
-    fb_free_image(plus_img);
-    fb_free_image(minus_img);
-    fb_free_image(reset_img);
-    fb_free_image(exit_img);
-    fb_free_image(show_img);
+    fb_latency_print(); // 触摸设备断开(例如回放结束)后才会走到这里
+    release_images();
     return 0;
 }
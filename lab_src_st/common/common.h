@@ -30,7 +30,17 @@ void task_add_timer(myTime period, Task_Func callback);
 
 void task_delete_file(int fd); /*删除文件任务*/
 void task_delete_timer(int period); /*删除定时器任务*/
-void task_loop(void); /*进入任务循环, 该函数不返回*/
+void task_loop(void); /*进入任务循环, 所有文件和定时器任务都删除后返回*/
+
+/*在常驻的工作线程上并行执行work(0..n-1, arg), 全部完成后才返回;
+  done不为NULL时, 每完成一项就在调用线程上调用一次done(index, arg).
+  另一个task_parallel正在执行时(例如在work里再调用), 在本线程依次执行*/
+typedef void (*Task_Work)(int index, void *arg);
+void task_parallel(int n, Task_Work work, Task_Work done, void *arg);
+
+/*把work(index, arg)交给后台线程按提交顺序执行, 立即返回;
+  完成后由task_loop通过管道在主线程上调用done(index, arg). 成功返回0, 失败返回-1*/
+int task_post(Task_Work work, Task_Work done, int index, void *arg);
 
 /*非阻塞方式读/写文件, 返回实际读/写的字节数*/
 int myRead_nonblock(int fd, void *p, int n);
@@ -43,20 +53,111 @@ int myWrite_nonblock(int fd, void *p, int n);
 #define FB_COLOR_RGB_8880	1
 #define FB_COLOR_RGBA_8888	2
 #define FB_COLOR_ALPHA_8	3
+#define FB_COLOR_RGB_565	4 /*16位, 不透明*/
+#define FB_COLOR_GRAY_8		5 /*8位灰度, 不透明*/
+#define FB_COLOR_PALETTE_8	6 /*8位索引, 颜色(含alpha)在palette中*/
+
+#define FB_PALETTE_SIZE	256
+
+/*0xAARRGGBB和RGB565互转*/
+#define FB_COLOR_TO_RGB565(c)	((((c)>>8)&0xf800)|(((c)>>5)&0x07e0)|(((c)>>3)&0x001f))
+#define FB_RGB565_TO_COLOR(p)	(0xff000000|\
+	((((p)&0xf800)<<8)|(((p)&0xe000)<<3))|\
+	((((p)&0x07e0)<<5)|(((p)&0x0600)>>1))|\
+	((((p)&0x001f)<<3)|(((p)&0x001c)>>2)))
+
+/*fb_image.flags: 图片内存的归属, fb_free_image据此决定如何释放*/
+#define FB_IMAGE_POOLED	0 /*头和像素一起从图片内存池分配*/
+#define FB_IMAGE_VIEW	1 /*只拥有头, 像素属于其他图片或映射的文件*/
+
+#define FB_IMAGE_ALIGN	64 /*fb_new_image分配的像素行按64字节对齐*/
 
 typedef struct {
 	int color_type; /* FB_COLOR_XXXX */
 	int pixel_w, pixel_h;
 	int line_byte;
-	char *content; /*4 byte align*/
+	char *content; /*FB_IMAGE_ALIGN byte align*/
+	int flags; /* FB_IMAGE_XXXX */
+	int *palette; /*FB_COLOR_PALETTE_8: 256个0xAARRGGBB颜色*/
+	int palette_opaque; /*FB_COLOR_PALETTE_8: 用到的颜色都不透明, 由fb_palette_update算出*/
 } fb_image;
 
+int fb_color_bytes(int color_type); /*每个像素的字节数*/
+
+/*line_byte小于最小行宽时(例如传0), 自动补齐到FB_IMAGE_ALIGN的倍数*/
 fb_image * fb_new_image(int color_type, int w, int h, int line_byte);
 void fb_free_image(fb_image *image);
+/*改写调色板后调用: 前num个颜色是图片用到的, 据此算出palette_opaque*/
+void fb_palette_update(fb_image *image, int num);
 
 fb_image * fb_read_jpeg_image(char *file);
 fb_image * fb_read_png_image(char *file);
 
+/*解码选项, 同时也是图片缓存键的一部分*/
+#define FB_DECODE_DEFAULT	0
+#define FB_DECODE_RGB565	1 /*解码成FB_COLOR_RGB_565(丢弃alpha)*/
+#define FB_DECODE_GRAY8		2 /*解码成FB_COLOR_GRAY_8*/
+#define FB_DECODE_PALETTE	3 /*不超过256色时解码成FB_COLOR_PALETTE_8, 否则保持原格式*/
+
+/*根据文件头自动选择jpeg/png解码*/
+fb_image * fb_load_image(char *file, int opts);
+
+/*解码并保持宽高比缩小到不超过max_w*max_h; JPEG在解码时就按1/2,1/4,1/8缩小, 比解码原图快得多*/
+fb_image * fb_load_image_fit(char *file, int max_w, int max_h);
+
+/*转换成另一种颜色类型, 转成FB_COLOR_PALETTE_8时超过256色返回NULL*/
+fb_image * fb_convert_image(const fb_image *img, int color_type);
+
+/*图片缓存: 同一文件(路径+mtime+解码选项相同)只解码一次, 返回的图片是共享的,
+  不能修改, 用完后调用fb_image_release而不是fb_free_image*/
+typedef struct {
+	int hits, misses;
+	int evictions;
+	int entries;
+	int bytes;	//缓存中图片占用的总字节数
+	int budget;	//总字节数上限, 超出时淘汰未被引用的图片
+} fb_image_cache_stat;
+
+/*预解码图片包: 由mkbundle工具从资源目录生成, 加载时直接mmap.
+  fb_bundle_get返回指向映射内存的图片(零拷贝), 用fb_free_image释放, 不能修改*/
+typedef struct fb_bundle fb_bundle;
+
+fb_bundle * fb_bundle_open(char *file);
+fb_image * fb_bundle_get(fb_bundle *bundle, const char *name);
+void fb_bundle_close(fb_bundle *bundle);
+/*names是相对root(NULL表示没有)的路径; mtimes(可以为NULL)是各源文件的mtime, 单位纳秒*/
+int fb_bundle_write(char *file, const char *root, char **names, fb_image **images, const long long *mtimes, int n);
+
+/*挂载后, fb_image_acquire("root/name")会优先从bundle中取名为"name"的图片;
+  源文件还在并且打包之后改过时, 仍然解码源文件*/
+void fb_image_cache_mount(fb_bundle *bundle);
+
+fb_image * fb_image_acquire(char *path);
+fb_image * fb_image_acquire_opt(char *path, int opts);
+void fb_image_release(fb_image *image);
+void fb_image_cache_set_budget(int bytes);
+void fb_image_cache_get_stat(fb_image_cache_stat *stat);
+
+/*缩略图缓存: 在cache_dir中按(路径,大小,mtime,w,h)查找预解码的缩略图并mmap,
+  没有时用fb_load_image_fit生成后写入. 返回的图片不能修改, 用fb_thumb_release释放*/
+fb_image * fb_thumb_acquire(char *file, int w, int h, const char *cache_dir);
+void fb_thumb_release(fb_image *thumb);
+
+/*并行加载一组资源(图片经由图片缓存, 字体调用font_init), 全部完成后返回失败的个数;
+  ready不为NULL时, 每个资源加载完就在调用线程上回调一次*/
+#define FB_ASSET_IMAGE	0
+#define FB_ASSET_FONT	1
+
+typedef struct {
+	int type; /* FB_ASSET_XXXX */
+	char *path;
+	int opts; /*图片的解码选项*/
+	fb_image *image; /*加载结果, 用fb_image_release释放*/
+} fb_asset;
+
+typedef void (*fb_asset_func)(fb_asset *asset);
+int fb_load_assets(fb_asset *assets, int n, fb_asset_func ready);
+
 /*得到一个图片的子图片,子图片和原图片共享颜色内存*/
 fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h);
 
@@ -76,6 +177,11 @@ fb_image * fb_read_font_image(const char *text, int pixel_size, fb_font_info *fo
 #define SCREEN_HEIGHT	576
 #define BITS_PER_PIXEL	32
 
+typedef struct {
+	int x, y;
+	int w, h;
+} fb_rect;
+
 void fb_init(char *dev);
 void fb_update(void);
 
@@ -94,6 +200,147 @@ void fb_draw_straight_line(int x, int y, int len, int direction, int color);
 void fb_draw_round(int x, int y, int r, int color);
 void fb_draw_thick_line(int sx, int sy, int dx, int dy, int r, int color);
 
+/*抗锯齿的粗线(两端是半圆)和圆: 坐标是像素中心, r是半径(半线宽). 每行只算一次范围,
+  完全覆盖的像素直接填, 边缘按像素中心到图形的距离混合, 每个像素只写一次*/
+void fb_draw_aa_line(int sx, int sy, int dx, int dy, float r, int color);
+void fb_draw_aa_round(int x, int y, float r, int color);
+
+/*一笔由多段抗锯齿粗线连成时, 相邻两段在连接处重叠, 各画一次边缘会混合两遍出现珠子.
+  fb_aa_cover给32位的target每个像素记下最后画它的笔号和覆盖率(2字节/像素), 同一笔再画到
+  这个像素时只补到两次覆盖率中较大的那个; 不同笔之间照常叠加*/
+typedef struct fb_aa_cover fb_aa_cover;
+fb_aa_cover * fb_aa_cover_new(fb_image *target);
+void fb_aa_cover_free(fb_aa_cover *cover);
+int fb_aa_cover_begin(fb_aa_cover *cover); /*开始新的一笔, 返回笔号*/
+void fb_draw_aa_stroke(fb_aa_cover *cover, int stroke, int sx, int sy, int dx, int dy, float r, int color);
+
+/*用tile平铺rect(NULL表示全屏), 图案的左上角对齐(0,0). RGB_8880的tile每行只是几次memcpy,
+  适合画网格, 棋盘格之类的背景*/
+void fb_fill_pattern(const fb_rect *rect, fb_image *tile);
+
+/*任意比例缩放, 返回新图片. 紧凑格式的图片输出为32位*/
+#define FB_FILTER_NEAREST	0
+#define FB_FILTER_BILINEAR	1
+#define FB_FILTER_BOX		2 /*面积平均, 适合缩小*/
+fb_image * fb_scale_image(const fb_image *img, int w, int h, int filter);
+
+/*把img中的src_rect(NULL表示整幅)缩放scale倍画在(x,y)处, 只计算clip(NULL表示全屏)内
+  可见的像素. scale是16.16定点数, FB_SCALE_ONE表示原大小*/
+#define FB_SCALE_ONE	65536
+void fb_draw_image_scaled(int x, int y, fb_image *img, const fb_rect *src_rect, int scale, const fb_rect *clip);
+
+/*绘图上下文: 往任意32位图片里画. 坐标都相对原点(目标图片坐标), 只画当前裁剪区
+  (裁剪栈顶)内的像素. 上面的fb_draw_*就是在屏幕上下文上画. 一个上下文只能在一个
+  线程里用, 不同线程可以各自往不同的图片里画; 屏幕上下文只能在主线程用*/
+#define FB_CLIP_DEPTH	8
+typedef struct {
+	fb_image *target;
+	int ox, oy; /*原点*/
+	int depth; /*裁剪栈深度, 至少为1*/
+	fb_rect clip[FB_CLIP_DEPTH]; /*目标图片坐标*/
+} fb_ctx;
+
+fb_ctx * fb_screen_ctx(void);
+void fb_ctx_init(fb_ctx *ctx, fb_image *target);
+void fb_ctx_set_origin(fb_ctx *ctx, int x, int y);
+int fb_ctx_push_clip(fb_ctx *ctx, int x, int y, int w, int h); /*与当前裁剪区求交, 栈满返回-1*/
+void fb_ctx_pop_clip(fb_ctx *ctx);
+
+void fb_ctx_draw_pixel(fb_ctx *ctx, int x, int y, int color);
+void fb_ctx_draw_rect(fb_ctx *ctx, int x, int y, int w, int h, int color);
+void fb_ctx_draw_border(fb_ctx *ctx, int x, int y, int w, int h, int color);
+void fb_ctx_draw_line(fb_ctx *ctx, int sx, int sy, int dx, int dy, int color);
+void fb_ctx_draw_image(fb_ctx *ctx, int x, int y, fb_image *image, int color);
+void fb_ctx_draw_text(fb_ctx *ctx, int x, int y, char *text, int font_size, int color);
+void fb_ctx_draw_straight_line(fb_ctx *ctx, int x, int y, int len, int direction, int color);
+void fb_ctx_draw_round(fb_ctx *ctx, int x, int y, int r, int color);
+void fb_ctx_draw_thick_line(fb_ctx *ctx, int sx, int sy, int dx, int dy, int r, int color);
+void fb_ctx_draw_aa_line(fb_ctx *ctx, int sx, int sy, int dx, int dy, float r, int color);
+void fb_ctx_draw_aa_round(fb_ctx *ctx, int x, int y, float r, int color);
+void fb_ctx_draw_aa_stroke(fb_ctx *ctx, fb_aa_cover *cover, int stroke, int sx, int sy, int dx, int dy, float r, int color);
+void fb_ctx_fill_pattern(fb_ctx *ctx, const fb_rect *rect, fb_image *tile); /*图案对齐原点, rect为NULL时铺满*/
+void fb_ctx_draw_image_scaled(fb_ctx *ctx, int x, int y, fb_image *img, const fb_rect *src_rect, int scale);
+
+/*图层: 离屏的图片, 有名字、位置、z顺序和不透明度(0~255). 图层变化时只记下屏幕上的
+  损坏区域, fb_update时只把变了的图层和它上面的图层在这些区域重新合成, 下面的图层不动.
+  直接画到屏幕上的内容会盖住图层, 直到同一位置有图层的内容变化, 或者上面的图层移走、
+  释放、改变z而从底下重新合成; 图层移走后露出的地方如果没有别的图层, 需要应用自己重画. 只有32位的图层可以用fb_layer_fill_rect/
+  fb_layer_draw_image往里画, 直接改fb_layer_image的内容后要调用fb_layer_damage*/
+typedef struct fb_layer fb_layer;
+fb_layer * fb_layer_new(const char *name, int w, int h, int z); /*RGB_8880, 初始为黑色*/
+fb_layer * fb_layer_new_image(const char *name, fb_image *img, int z); /*使用img, 不复制也不释放*/
+fb_layer * fb_layer_find(const char *name);
+void fb_layer_free(fb_layer *layer);
+fb_image * fb_layer_image(fb_layer *layer);
+void fb_layer_damage(fb_layer *layer, const fb_rect *rect); /*rect是图层内坐标, NULL表示整个图层*/
+void fb_layer_move(fb_layer *layer, int x, int y);
+void fb_layer_set_z(fb_layer *layer, int z);
+void fb_layer_set_opacity(fb_layer *layer, int opacity);
+void fb_layer_fill_rect(fb_layer *layer, int x, int y, int w, int h, int color);
+void fb_layer_draw_image(fb_layer *layer, int x, int y, fb_image *image, int color);
+
+/*触摸到显示的延迟: touch_read_frame取出的每一帧都调用fb_latency_input记下内核时间戳,
+  之后第一次真正把像素交给显示的fb_update把(刷新时刻 - 最早未显示的输入时刻)记入直方图.
+  没画任何东西的fb_update会丢掉未显示的输入. 时间都是CLOCK_MONOTONIC的微秒数*/
+#define FB_LATENCY_BUCKETS	64 /*第i格是[i, i+1)毫秒, 最后一格包含更长的*/
+typedef struct {
+	int count;
+	int hist[FB_LATENCY_BUCKETS];
+	int last_us, min_us, max_us;
+	long long sum_us;
+} fb_latency_stat;
+long long fb_time_us(void);
+void fb_latency_input(long long time_us);
+void fb_latency_get_stat(fb_latency_stat *stat);
+int fb_latency_percentile(const fb_latency_stat *stat, int percent); /*返回毫秒, 没有样本时返回-1*/
+void fb_latency_reset(void);
+void fb_latency_print(void); /*打印样本数和各百分位, 回放结束后看结果用*/
+/*在屏幕右下角的图层里显示最近一次延迟和p50/p95, 每FB_LATENCY_OVERLAY_MS刷新一次;
+  设置了环境变量FB_LATENCY_OVERLAY时fb_init会自动打开. 需要先font_init.
+  刷新只重新合成这个图层, 不会盖掉其它地方直接画的内容; 关掉后它的位置要由应用重画*/
+#define FB_LATENCY_OVERLAY_MS	500
+void fb_latency_overlay(int on);
+
+/*按EXIF的方向值旋转/翻转图片, 返回新图片; ROT_90表示顺时针转90度*/
+#define FB_ORIENT_NORMAL	1
+#define FB_ORIENT_FLIP_H	2
+#define FB_ORIENT_ROT_180	3
+#define FB_ORIENT_FLIP_V	4
+#define FB_ORIENT_TRANSPOSE	5
+#define FB_ORIENT_ROT_90	6
+#define FB_ORIENT_TRANSVERSE	7
+#define FB_ORIENT_ROT_270	8
+fb_image * fb_rotate_image(const fb_image *img, int orient);
+
+/*平移rect内已画好的内容, 返回新露出需要重画的区域个数(0~2), 区域写入exposed*/
+int fb_scroll_area(const fb_rect *rect, int dx, int dy, fb_rect exposed[2]);
+
+/*图片金字塔: 保存原图的1/2, 1/4, ...缩小版本, 各层在第一次用到时生成.
+  原图归调用者, 金字塔存在期间不能释放*/
+typedef struct fb_pyramid fb_pyramid;
+
+fb_pyramid * fb_pyramid_new(fb_image *img);
+void fb_pyramid_free(fb_pyramid *p);
+fb_image * fb_pyramid_level(fb_pyramid *p, int n); /*第n层(原图的1/2^n), 归金字塔所有*/
+/*从不小于目标尺寸的最小一层缩放到w*h; 正好是某一层时返回共享像素的子图片.
+  返回的图片都用fb_free_image释放*/
+fb_image * fb_pyramid_scale(fb_pyramid *p, int w, int h);
+
+/*可撤销的画布: target(32位, 例如fb_screen_ctx()->target)按FB_CANVAS_TILE分块记录历史,
+  每一步只保存这一步改动过的块. 改动target之前都要先用fb_canvas_modify说明要改哪里.
+  历史(包括各块最初的样子)超过history_bytes时丢掉最早的步骤*/
+#define FB_CANVAS_TILE	64
+typedef struct fb_canvas fb_canvas;
+
+fb_canvas * fb_canvas_new(fb_image *target, int history_bytes);
+void fb_canvas_free(fb_canvas *c);
+void fb_canvas_modify(fb_canvas *c, int x, int y, int w, int h); /*画之前调用, 第一次改的块先保存原样*/
+int fb_canvas_snapshot(fb_canvas *c); /*结束当前这一步, 没有改动时返回0*/
+/*撤销/重做一步, 只写回这一步改过的块, 没有可撤销/重做的返回0. 画到屏幕时之后要fb_update*/
+int fb_canvas_undo(fb_canvas *c);
+int fb_canvas_redo(fb_canvas *c);
+int fb_canvas_revert(fb_canvas *c); /*改过的块都恢复成最初的样子, 作为可以撤销的一步*/
+
 /*=========================== input.c ===============================*/
 
 /*lab4*/
@@ -104,13 +351,91 @@ void fb_draw_thick_line(int sx, int sy, int dx, int dy, int r, int color);
 #define TOUCH_ERROR	9
 #define FINGER_NUM_MAX	5
 
-int touch_init(char *dev); /*返回touch_fd*/
+/*返回touch_fd. 环境变量TOUCH_DEV可以替换dev; dev不是字符设备时当作touchrec录下的文件
+  或管道, 由后台线程按录制时的节奏回放, 设置了TOUCH_REPLAY_FAST时一帧接一帧尽快回放.
+  回放结束时touch_fd读到文件结束, 和设备断开一样.
+  坐标按设备报告的范围(EVIOCGABS)换算到屏幕, 读不到范围时按[0,4096); 环境变量TOUCH_ORIENT
+  (FB_ORIENT_*的值)指定触摸屏相对屏幕的方向*/
+int touch_init(char *dev);
 int touch_read(int touch_fd, int *x, int *y, int *finger);
+/*打开所有多点触摸设备(最多4个)并用task_add_file加进任务循环, 返回打开的个数.
+  设置了TOUCH_DEV时只打开它. 手指编号按设备各算各的. 这些设备都直接读, 不经过输入线程*/
+int touch_open_all(Task_Func callback);
+/*关掉touch_init等打开的fd并释放它的状态, 先task_delete_file. 对touch_thread_start返回的fd
+  (或它的touch_fd)调用时先停掉输入线程, 再把两个fd一起关掉. 不认识的fd返回-1.
+  touch_read*对不认识的fd(没经过touch_init, 或已经touch_close)返回TOUCH_ERROR或-1*/
+int touch_close(int touch_fd);
+/*改变坐标映射, 失败返回-1. 方向是FB_ORIENT_*, ROT_90表示触摸坐标顺时针转90度得到屏幕坐标;
+  范围是原始坐标的最小和最大值, 回放别的面板录下的文件时用. 在touch_thread_start之后调用时
+  对它返回的fd设置*/
+int touch_set_orient(int touch_fd, int orient);
+int touch_set_range(int touch_fd, int min_x, int max_x, int min_y, int max_y);
+
+/*可选的输入线程: 在独立线程里不停地读touch_fd, 存进单生产者单消费者的无锁环形缓冲,
+  渲染再慢也不会因为内核缓冲溢出而丢事件; 内核真的丢了(SYN_DROPPED)时用EVIOCGMTSLOTS
+  读回当前状态补上. 返回一个eventfd, 用它代替touch_fd调用task_add_file和touch_read*.
+  只有一个输入线程, 同时只能给一个设备用, 已经启动过时返回-1, touch_close之后才能再给别的设备用;
+  touch_open_all打开的多个设备只能直接读. 失败返回-1. 回放时直接返回touch_fd*/
+#define TOUCH_RING_SIZE	4096 /*环形缓冲能放的事件数, 必须是2的幂*/
+int touch_thread_start(int touch_fd);
+
+/*按SYN_REPORT分帧读: 一帧里所有手指的完整状态*/
+#define TOUCH_READ_EVENTS	64 /*一次read最多读的事件数*/
+typedef struct {
+	int x, y;
+	int event; /*这一帧里的变化: TOUCH_NO_EVENT/TOUCH_PRESS/TOUCH_MOVE/TOUCH_RELEASE*/
+	int down; /*帧结束时是否按着*/
+	long long time; /*最后一次变化的时间戳, CLOCK_MONOTONIC微秒*/
+} touch_slot;
+typedef struct {
+	long long time; /*SYN_REPORT的时间戳, CLOCK_MONOTONIC微秒*/
+	int changed; /*event不是TOUCH_NO_EVENT的槽的位掩码*/
+	touch_slot slot[FINGER_NUM_MAX];
+} touch_frame;
+/*fd可读时调用: 一次read取出已到达的全部事件, 每个有变化的SYN_REPORT写出一帧.
+  返回写出的帧数, 出错返回-1. 返回max_frames时缓冲里可能还有事件, 再调用一次即可;
+  返回值小于max_frames说明已经读空. 不要和touch_read混用同一个fd*/
+int touch_read_frame(int touch_fd, touch_frame *frames, int max_frames);
+
+/*合并模式: 取出全部已到达的帧, 把连续的移动合并成一帧, 每个手指只给最新的位置.
+  paths不为NULL时paths[finger]依次记下被合并的各帧的位置(最后一点就是最新位置),
+  画笔迹用; 点数超过TOUCH_PATH_MAX时隔一个丢一个, 轨迹均匀变稀. 按下和松开不会被合并掉,
+  遇到时先返回前面合并好的帧, 所以要一直调用到返回0为止. 出错返回-1*/
+#define TOUCH_PATH_MAX	32
+typedef struct {
+	int num;
+	struct { int x, y; long long time; } pt[TOUCH_PATH_MAX];
+	int total, stride; /*内部用: 收到的点数, 满了以后每stride个点记一个*/
+} touch_path;
+int touch_read_coalesced(int touch_fd, touch_frame *frame, touch_path *paths);
+
+/*笔迹滤波: 每个手指一份状态, 用1€滤波去抖(慢时平滑, 快时跟手), 再按滤波后的速度
+  (和加速度)外推predict_ms毫秒, 画在手指前面抵消一部分延迟. 坐标是屏幕像素*/
+typedef struct {
+	float min_cutoff; /*慢速时的截止频率(Hz), 越小越平滑*/
+	float beta; /*截止频率随速度增加的系数, 越大快速移动时越跟手*/
+	float d_cutoff; /*速度的截止频率(Hz)*/
+	int predict_ms; /*预测多远, 0表示不预测*/
+	int predict_order; /*1: 按速度线性外推; 2: 再加上加速度*/
+} touch_filter_param;
+typedef struct {
+	int valid;
+	long long time;
+	float x, y; /*滤波后的位置*/
+	float vx, vy; /*滤波后的速度, 像素/秒*/
+	float ax, ay; /*滤波后的加速度, 像素/秒^2*/
+} touch_filter_finger;
+typedef struct {
+	touch_filter_param param;
+	touch_filter_finger finger[FINGER_NUM_MAX];
+} touch_filter;
+void touch_filter_init(touch_filter *f, const touch_filter_param *param); /*param为NULL时用默认参数*/
+void touch_filter_reset(touch_filter *f, int finger); /*手指按下时调用, 丢掉上一笔的状态*/
+void touch_filter_point(touch_filter *f, int finger, int *x, int *y, long long time); /*滤波后写回x,y*/
+int touch_filter_predict(const touch_filter *f, int finger, int *x, int *y); /*还没有点时返回-1*/
 
 #endif /* _COMMON_H_ */
 
 /*com-lab*/
-fb_image* zoomin_image(const fb_image *img);
-fb_image* zoomout_image(const fb_image *img);
 fb_image* zoom_image(const fb_image *img, int level);
 fb_image* fb_copy_image(const fb_image *img);
\ No newline at end of file
@@ -3,39 +3,146 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <linux/fb.h>
+#include <setjmp.h>
+#include <limits.h>
 
 #include "common.h"
 
-/*w, h maybe == 0*/
-fb_image * fb_new_image(int color_type, int w, int h, int line_byte)
+/*================== image memory pool ===============*/
+/* 图片的头和像素放在同一块内存里: 头占用前FB_IMAGE_ALIGN字节, 像素从块内
+ * 偏移FB_IMAGE_ALIGN处开始, 每行按FB_IMAGE_ALIGN对齐.
+ * 不超过256KB的块按2的幂分成尺寸类, 释放后留在空闲链表里供下次复用,
+ * 这样fb_draw_text每个字符的临时图片不再走malloc/free. */
+
+#define POOL_CLASS_MIN	10	/* 1KB */
+#define POOL_CLASS_NUM	9	/* 1KB ~ 256KB */
+#define POOL_KEEP_MAX	16	/*每个尺寸类最多保留的空闲块*/
+#define POOL_CLASS_NONE	POOL_CLASS_NUM	/*太大, 不进池, 直接分配*/
+#define POOL_CLASS_SHIFT	8	/*尺寸类保存在flags的高位, 总是非负*/
+
+static struct {
+	void *free_list;
+	int count;
+} pools[POOL_CLASS_NUM];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int _pool_class(size_t size)
 {
-	fb_image *image;
+	int c;
+	for(c=0; c<POOL_CLASS_NUM; ++c)
+	{
+		if(size <= ((size_t)1 << (c+POOL_CLASS_MIN))) return c;
+	}
+	return POOL_CLASS_NONE;
+}
 
-	if((w<0)||(h<0)) return NULL;
+static void *_pool_alloc(size_t size, int *pclass)
+{
+	void *p = NULL;
+	int c = _pool_class(size);
+
+	*pclass = c;
+	if(c != POOL_CLASS_NONE) {
+		pthread_mutex_lock(&pool_lock);
+		p = pools[c].free_list;
+		if(p != NULL) {
+			pools[c].free_list = *(void **)p;
+			pools[c].count--;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		if(p != NULL) return p;
+		size = 1 << (c+POOL_CLASS_MIN);
+	}
+	if(posix_memalign(&p, FB_IMAGE_ALIGN, size) != 0) return NULL;
+	return p;
+}
+
+static void _pool_free(void *p, unsigned int c)
+{
+	if(c < POOL_CLASS_NUM) {
+		pthread_mutex_lock(&pool_lock);
+		if(pools[c].count < POOL_KEEP_MAX) {
+			*(void **)p = pools[c].free_list;
+			pools[c].free_list = p;
+			pools[c].count++;
+			p = NULL;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+	free(p);
+}
+
+int fb_color_bytes(int color_type)
+{
 	switch(color_type)
 	{
 	case FB_COLOR_RGB_8880:
 	case FB_COLOR_RGBA_8888:
-		if(line_byte < w*4) line_byte = w*4;
-		break;
+		return 4;
+	case FB_COLOR_RGB_565:
+		return 2;
 	case FB_COLOR_ALPHA_8:
-		if(line_byte < w) line_byte = w;
-		break;
-	default:
-		return NULL;
+	case FB_COLOR_GRAY_8:
+	case FB_COLOR_PALETTE_8:
+		return 1;
 	}
+	return 0;
+}
+
+/*w, h maybe == 0*/
+fb_image * fb_new_image(int color_type, int w, int h, int line_byte)
+{
+	fb_image *image;
+	int min_line, c, pixel_bytes;
+	size_t bytes, pal_off;
+
+	if((w<0)||(h<0)) return NULL;
+	pixel_bytes = fb_color_bytes(color_type);
+	if(pixel_bytes == 0) return NULL; /*不支持的颜色类型, w==0时也要检查*/
+	if(w > (INT_MAX - FB_IMAGE_ALIGN)/pixel_bytes) return NULL;
+	min_line = w*pixel_bytes;
+
+	/*没有指定行宽时, 行宽补齐到FB_IMAGE_ALIGN, 每一行都对齐*/
+	if(line_byte < min_line)
+		line_byte = (min_line + FB_IMAGE_ALIGN-1) & ~(FB_IMAGE_ALIGN-1);
+
+	/*整块不超过INT_MAX, 其它地方都按int计算y*line_byte之类的偏移*/
+	if((h > 0)&&((size_t)line_byte > (INT_MAX - FB_IMAGE_ALIGN - FB_PALETTE_SIZE*4 - 3)/(size_t)h))
+		return NULL;
+
+	/*调色板放在像素之后*/
+	pal_off = (FB_IMAGE_ALIGN + (size_t)line_byte*h + 3) & ~(size_t)3;
+	bytes = pal_off;
+	if(color_type == FB_COLOR_PALETTE_8) bytes += FB_PALETTE_SIZE*4;
 
-	image = (fb_image *)malloc(sizeof(fb_image) + line_byte*h);
+	image = (fb_image *)_pool_alloc(bytes, &c);
 	if(image == NULL) return NULL;
 
 	image->color_type = color_type;
 	image->line_byte = line_byte;
 	image->pixel_w = w;
 	image->pixel_h = h;
-	image->content = (char *)(image+1);
+	image->content = (char *)image + FB_IMAGE_ALIGN;
+	image->flags = FB_IMAGE_POOLED | (c << POOL_CLASS_SHIFT);
+	image->palette = NULL;
+	image->palette_opaque = 0;
+	if(color_type == FB_COLOR_PALETTE_8) {
+		image->palette = (int *)((char *)image + pal_off);
+		memset(image->palette, 0, FB_PALETTE_SIZE*4);
+	}
 	return image;
 }
 
+void fb_palette_update(fb_image *image, int num)
+{
+	int i;
+	if((image == NULL)||(image->palette == NULL)) return;
+	if(num > FB_PALETTE_SIZE) num = FB_PALETTE_SIZE;
+	image->palette_opaque = (num > 0);
+	for(i=0; i<num; ++i)
+		if(((unsigned int)image->palette[i] >> 24) != 0xff) image->palette_opaque = 0;
+}
+
 fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h)
 {
 	fb_image *ret;
@@ -43,7 +150,7 @@ fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h)
 	if((x<0)||(y<0)||
 		(w<0)||(h<0)||
 		(x+w > img->pixel_w)||
-		(y+h > img->pixel_w))
+		(y+h > img->pixel_h))
 		return NULL;
 
 	ret = (fb_image *)malloc(sizeof(fb_image));
@@ -52,30 +159,207 @@ fb_image *fb_get_sub_image(fb_image *img, int x, int y, int w, int h)
 		ret->line_byte = img->line_byte;
 		ret->pixel_w = w;
 		ret->pixel_h = h;
-		if(img->color_type != FB_COLOR_ALPHA_8) x*=4;
-		ret->content = img->content + y*img->line_byte + x;
+		ret->content = img->content + y*img->line_byte + x*fb_color_bytes(img->color_type);
+		ret->flags = FB_IMAGE_VIEW;
+		ret->palette = img->palette;
+		ret->palette_opaque = img->palette_opaque;
 	}
 	return ret;
 }
 
 void fb_free_image(fb_image *image)
 {
-	if(image) free(image);
+	if(image == NULL) return;
+	if((image->flags & FB_IMAGE_VIEW) == 0)
+		_pool_free(image, (unsigned int)image->flags >> POOL_CLASS_SHIFT);
+	else
+		free(image);
+}
+
+/*================== convert color type ===============*/
+/* 逐行转换: 先把源行展开成0xAARRGGBB, 再写成目标格式.
+ * 只在解码/打包时使用, 不在绘制的热路径上. */
+
+static void _load_row(const fb_image *img, int y, unsigned int *argb)
+{
+	const unsigned char *src = (const unsigned char *)img->content + y*img->line_byte;
+	int x, w = img->pixel_w;
+	switch(img->color_type)
+	{
+	case FB_COLOR_RGB_8880:
+		for(x=0; x<w; ++x) argb[x] = ((const unsigned int *)src)[x] | 0xff000000;
+		break;
+	case FB_COLOR_RGBA_8888:
+		memcpy(argb, src, w*4);
+		break;
+	case FB_COLOR_RGB_565:
+		for(x=0; x<w; ++x) argb[x] = FB_RGB565_TO_COLOR(((const unsigned short *)src)[x]);
+		break;
+	case FB_COLOR_GRAY_8:
+		for(x=0; x<w; ++x) argb[x] = 0xff000000 | (src[x]*0x010101);
+		break;
+	case FB_COLOR_PALETTE_8:
+		for(x=0; x<w; ++x) argb[x] = img->palette[src[x]];
+		break;
+	}
+}
+
+/*查找或加入调色板, 超过256色返回-1*/
+#define PALETTE_HASH_SIZE	1024
+static int _palette_index(unsigned int *keys, short *index, int *palette, int *count, unsigned int color)
+{
+	unsigned int h = (color * 2654435761u) >> 22;
+	while(index[h] >= 0)
+	{
+		if(keys[h] == color) return index[h];
+		h = (h+1) & (PALETTE_HASH_SIZE-1);
+	}
+	if(*count == FB_PALETTE_SIZE) return -1;
+	keys[h] = color;
+	index[h] = *count;
+	palette[*count] = color;
+	return (*count)++;
+}
+
+fb_image *fb_convert_image(const fb_image *img, int color_type)
+{
+	unsigned int *argb, keys[PALETTE_HASH_SIZE];
+	short index[PALETTE_HASH_SIZE];
+	fb_image *out;
+	int x, y, w, count = 0;
+
+	if((img == NULL)||(fb_color_bytes(img->color_type) == 0)||
+		(img->color_type == FB_COLOR_ALPHA_8)||(color_type == FB_COLOR_ALPHA_8))
+		return NULL;
+	w = img->pixel_w;
+	out = fb_new_image(color_type, w, img->pixel_h, 0);
+	if(out == NULL) return NULL;
+	argb = (unsigned int *)malloc((w > 0 ? w : 1)*4);
+	if(argb == NULL) {
+		fb_free_image(out);
+		return NULL;
+	}
+	memset(index, -1, sizeof(index));
+
+	for(y=0; y<img->pixel_h; ++y)
+	{
+		unsigned char *dst = (unsigned char *)out->content + y*out->line_byte;
+		_load_row(img, y, argb);
+		switch(color_type)
+		{
+		case FB_COLOR_RGB_8880:
+		case FB_COLOR_RGBA_8888:
+			memcpy(dst, argb, w*4);
+			break;
+		case FB_COLOR_RGB_565:
+			for(x=0; x<w; ++x) ((unsigned short *)dst)[x] = FB_COLOR_TO_RGB565(argb[x]);
+			break;
+		case FB_COLOR_GRAY_8:
+			for(x=0; x<w; ++x) /* (77R+150G+29B)/256 */
+				dst[x] = ((argb[x]>>16&0xff)*77 + (argb[x]>>8&0xff)*150 + (argb[x]&0xff)*29) >> 8;
+			break;
+		case FB_COLOR_PALETTE_8:
+			for(x=0; x<w; ++x) {
+				int i = _palette_index(keys, index, out->palette, &count, argb[x]);
+				if(i < 0) goto fail; /*颜色太多*/
+				dst[x] = i;
+			}
+			break;
+		}
+	}
+	free(argb);
+	if(color_type == FB_COLOR_PALETTE_8) fb_palette_update(out, count);
+	return out;
+
+fail:
+	free(argb);
+	fb_free_image(out);
+	return NULL;
+}
+
+/*按解码选项转换刚解码出的图片, 无法转换时保留原图*/
+static fb_image *_apply_decode_opts(fb_image *image, int opts)
+{
+	fb_image *out;
+	int type;
+
+	switch(opts)
+	{
+	case FB_DECODE_RGB565: type = FB_COLOR_RGB_565; break;
+	case FB_DECODE_GRAY8: type = FB_COLOR_GRAY_8; break;
+	case FB_DECODE_PALETTE: type = FB_COLOR_PALETTE_8; break;
+	default: return image;
+	}
+	if((image == NULL)||(image->color_type == type)) return image;
+	out = fb_convert_image(image, type);
+	if(out == NULL) return image;
+	fb_free_image(image);
+	return out;
 }
 
 /*================== read a jpeg image ===============*/
 #include <jpeglib.h>
-fb_image *fb_read_jpeg_image(char *file)
+/*默认的错误处理会直接exit, 换成跳回_read_jpeg, 损坏的文件只返回NULL*/
+typedef struct {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+} jpeg_error_jmp;
+
+static void _jpeg_error_exit(j_common_ptr cinfo)
 {
-	fb_image *image;
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((jpeg_error_jmp *)cinfo->err)->jmp, 1);
+}
+
+/*从APP1里的EXIF(TIFF格式)中找IFD0的Orientation(0x0112)标签, 没有时返回FB_ORIENT_NORMAL*/
+static int _exif_orientation(const unsigned char *p, unsigned int len)
+{
+	if((len < 14)||(memcmp(p, "Exif\0\0", 6) != 0)) return FB_ORIENT_NORMAL;
+	p += 6;
+	len -= 6;
+	int le = (p[0] == 'I'); /*"II"小端, "MM"大端*/
+#define EXIF_U16(q) (le ? ((q)[0] | ((q)[1] << 8)) : (((q)[0] << 8) | (q)[1]))
+#define EXIF_U32(q) (le ? ((unsigned int)EXIF_U16(q) | ((unsigned int)EXIF_U16((q)+2) << 16)) \
+			: (((unsigned int)EXIF_U16(q) << 16) | (unsigned int)EXIF_U16((q)+2)))
+	unsigned int ifd = EXIF_U32(p + 4);
+	if((ifd > len - 2)||(ifd < 8)) return FB_ORIENT_NORMAL;
+	int n = EXIF_U16(p + ifd);
+	const unsigned char *e = p + ifd + 2;
+	for(; (n > 0)&&(e + 12 <= p + len); --n, e += 12) {
+		if(EXIF_U16(e) == 0x0112) {
+			int v = EXIF_U16(e + 8);
+			return ((v >= FB_ORIENT_NORMAL)&&(v <= FB_ORIENT_ROT_270)) ? v : FB_ORIENT_NORMAL;
+		}
+	}
+#undef EXIF_U16
+#undef EXIF_U32
+	return FB_ORIENT_NORMAL;
+}
+
+/*保持宽高比缩小到不超过max_w*max_h, 不放大*/
+static void _fit_size(int *w, int *h, int max_w, int max_h)
+{
+	if(*w > max_w) {
+		*h = (int)((long long)*h * max_w / *w);
+		*w = max_w;
+	}
+	if(*h > max_h) {
+		*w = (int)((long long)*w * max_h / *h);
+		*h = max_h;
+	}
+	if(*w < 1) *w = 1;
+	if(*h < 1) *h = 1;
+}
+
+/*fit_w/fit_h大于0时, 用scale_denom在解码时就缩小到不小于fit尺寸的最小的1/2,1/4,1/8*/
+static fb_image *_read_jpeg(char *file, int opts, int fit_w, int fit_h)
+{
+	fb_image * volatile image = NULL;
+	unsigned int * volatile row_buf = NULL;
 	//指定错误处理器
-	struct jpeg_error_mgr errpub;
+	jpeg_error_jmp errjmp;
 	//申请jpeg解压对象
 	struct jpeg_decompress_struct cinfo;
-	//将错误处理结构对象绑定在JPEG对象上
-	cinfo.err = jpeg_std_error(&errpub);
-	//初始化cinfo结构
-	jpeg_create_decompress(&cinfo);
 
 	//指定解压数据源
 	FILE *infile;
@@ -83,19 +367,66 @@ fb_image *fb_read_jpeg_image(char *file)
 		printf("fb_read_jpeg_image: Failed to open file %s", file);
 		return NULL;
 	}
+	//将错误处理结构对象绑定在JPEG对象上
+	cinfo.err = jpeg_std_error(&errjmp.pub);
+	errjmp.pub.error_exit = _jpeg_error_exit;
+	if(setjmp(errjmp.jmp)) { /*解码出错*/
+		free(row_buf);
+		fb_free_image(image);
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return NULL;
+	}
+	//初始化cinfo结构
+	jpeg_create_decompress(&cinfo);
 	jpeg_stdio_src(&cinfo, infile);
+	jpeg_save_markers(&cinfo, JPEG_APP0+1, 0xffff); //保留EXIF, 用来取方向
 
 	//获取文件信息
 	jpeg_read_header(&cinfo, TRUE);
+	int orient = FB_ORIENT_NORMAL;
+	jpeg_saved_marker_ptr m;
+	for(m = cinfo.marker_list; m != NULL; m = m->next) {
+		if(m->marker == JPEG_APP0+1) {
+			orient = _exif_orientation(m->data, m->data_length);
+			break;
+		}
+	}
+	if((fit_w > 0)&&(fit_h > 0)) {
+		int w = cinfo.image_width, h = cinfo.image_height;
+		int turned = (orient >= FB_ORIENT_TRANSPOSE); //转正之后再适配
+		/*setjmp之后不改参数, 否则longjmp回来时它们的值不确定(-Wclobbered)*/
+		_fit_size(&w, &h, turned ? fit_h : fit_w, turned ? fit_w : fit_h);
+		cinfo.scale_num = 1;
+		cinfo.scale_denom = 1;
+		while((cinfo.scale_denom < 8)&&
+			(cinfo.image_width/(cinfo.scale_denom*2) >= (unsigned int)w)&&
+			(cinfo.image_height/(cinfo.scale_denom*2) >= (unsigned int)h))
+			cinfo.scale_denom *= 2;
+	}
 	//为解压缩设定参数
 	cinfo.dct_method = JDCT_IFAST;
 	cinfo.do_fancy_upsampling = FALSE;
 	cinfo.out_color_space = JCS_EXT_BGRX; //输出图像的色彩空间
+	int color_type = FB_COLOR_RGB_8880;
+	if(opts == FB_DECODE_GRAY8) {
+		cinfo.out_color_space = JCS_GRAYSCALE;
+		color_type = FB_COLOR_GRAY_8;
+	} else if(opts == FB_DECODE_RGB565) {
+		color_type = FB_COLOR_RGB_565; //逐行解码成BGRX再压缩
+	}
 	
 	//开始解压缩
 	jpeg_start_decompress(&cinfo);
 
-	image = (fb_image *)fb_new_image(FB_COLOR_RGB_8880, cinfo.output_width, cinfo.output_height, 0);
+	image = (fb_image *)fb_new_image(color_type, cinfo.output_width, cinfo.output_height, 0);
+	if((image != NULL)&&(color_type == FB_COLOR_RGB_565)) {
+		row_buf = (unsigned int *)malloc(cinfo.output_width*4);
+		if(row_buf == NULL) {
+			fb_free_image(image);
+			image = NULL;
+		}
+	}
 	if(image == NULL){
 		jpeg_destroy_decompress(&cinfo);
 		fclose(infile);
@@ -105,21 +436,43 @@ fb_image *fb_read_jpeg_image(char *file)
 	char *dst_row = image->content;
 	int dst_line = image->line_byte;
 	while(cinfo.output_scanline < cinfo.output_height){
-		jpeg_read_scanlines(&cinfo, (JSAMPARRAY)&dst_row, 1);
+		if(row_buf != NULL) {
+			unsigned int x;
+			jpeg_read_scanlines(&cinfo, (JSAMPARRAY)&row_buf, 1);
+			for(x=0; x<cinfo.output_width; ++x)
+				((unsigned short *)dst_row)[x] = FB_COLOR_TO_RGB565(row_buf[x]);
+		} else {
+			jpeg_read_scanlines(&cinfo, (JSAMPARRAY)&dst_row, 1);
+		}
 		dst_row += dst_line;
 	}
+	free(row_buf);
+	row_buf = NULL;
 
 	//解压缩完毕
 	jpeg_finish_decompress(&cinfo);
 	//释放资源
 	jpeg_destroy_decompress(&cinfo);
 	fclose(infile);
+
+	if(orient != FB_ORIENT_NORMAL) { //按EXIF方向转正
+		fb_image *rotated = fb_rotate_image(image, orient);
+		if(rotated != NULL) {
+			fb_free_image(image);
+			image = rotated;
+		}
+	}
 	return image;
 }
 
+fb_image *fb_read_jpeg_image(char *file)
+{
+	return _read_jpeg(file, FB_DECODE_DEFAULT, 0, 0);
+}
+
 /*================== read a png image ===============*/
 #include <png.h>
-fb_image *fb_read_png_image(char *file)
+static fb_image *_read_png(char *file, int opts)
 {
 	fb_image *image=NULL;
 	png_structp png_ptr;
@@ -165,29 +518,24 @@ fb_image *fb_read_png_image(char *file)
 	//bind libpng with fp
 	png_init_io(png_ptr, fp);
 	png_set_sig_bytes(png_ptr, 0);
-	
-	png_read_png(png_ptr, info_ptr, 
-		PNG_TRANSFORM_STRIP_16|
-		PNG_TRANSFORM_PACKING|
-		PNG_TRANSFORM_EXPAND|
-		PNG_TRANSFORM_BGR, NULL);
-	
-	image = (fb_image *)malloc(sizeof(fb_image));
-	if(image == NULL){
-		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		fclose(fp);
-		return NULL;
-	}
+	png_read_info(png_ptr, info_ptr);
 
-	if(png_get_bit_depth(png_ptr, info_ptr) == 16) {
-		png_set_strip_16(png_ptr);
+	int png_color = png_get_color_type(png_ptr, info_ptr);
+	int png_depth = png_get_bit_depth(png_ptr, info_ptr);
+	//调色板图片按需保留8位索引, 其余都展开成BGRA
+	int keep_index = (opts == FB_DECODE_PALETTE)&&(png_color == PNG_COLOR_TYPE_PALETTE);
+	if(png_depth == 16) png_set_strip_16(png_ptr);
+	if(png_depth < 8) png_set_packing(png_ptr);
+	if(!keep_index) {
+		png_set_expand(png_ptr);
+		png_set_gray_to_rgb(png_ptr);
+		png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+		png_set_bgr(png_ptr);
 	}
-	/*if(png_get_valid(png_ptr,info_ptr,PNG_INFO_tRNS)) {
-		png_set_tRNS_to_alpha(png_ptr);
-	}*/
+	png_read_update_info(png_ptr, info_ptr);
 
 	//not support color type
-	if(png_get_channels(png_ptr, info_ptr) != 4) {
+	if(png_get_channels(png_ptr, info_ptr) != (keep_index ? 1 : 4)) {
 		printf("unrecognized image format.\n");
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		fclose(fp);
@@ -195,31 +543,677 @@ fb_image *fb_read_png_image(char *file)
 	}
 	int pngheight =png_get_image_height(png_ptr, info_ptr);
 	int pngwidth = png_get_image_width(png_ptr, info_ptr);
-	image = fb_new_image(FB_COLOR_RGBA_8888,pngwidth, pngheight , 0);
-	if(image == NULL){
+	image = fb_new_image(keep_index ? FB_COLOR_PALETTE_8 : FB_COLOR_RGBA_8888, pngwidth, pngheight , 0);
+	png_bytep *row_pointers = (png_bytep *)malloc((pngheight > 0 ? pngheight : 1)*sizeof(png_bytep));
+	if((image == NULL)||(row_pointers == NULL)){
+		free(row_pointers);
+		fb_free_image(image);
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		fclose(fp);
 		return NULL;
 	}
-	
-	char *dst = image->content;
-	char **row_pointers;
-	char *src;
-	row_pointers = (char **)png_get_rows(png_ptr, info_ptr);
-	int i = 0;
-	while(i <pngheight )
-	{
-		src = row_pointers[i];
-		memcpy(dst, src, pngwidth * 4);
-		dst += image->line_byte;
-		++i;
+
+	if(keep_index) {
+		png_colorp plte;
+		png_bytep trans = NULL;
+		int num_plte = 0, num_trans = 0, i;
+		png_get_PLTE(png_ptr, info_ptr, &plte, &num_plte);
+		png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL);
+		for(i=0; i<num_plte && i<FB_PALETTE_SIZE; ++i) {
+			int a = (i < num_trans) ? trans[i] : 0xff;
+			image->palette[i] = (a<<24)|(plte[i].red<<16)|(plte[i].green<<8)|plte[i].blue;
+		}
+		fb_palette_update(image, num_plte);
 	}
 
+	//直接解码到图片的每一行
+	int i;
+	for(i=0; i<pngheight; ++i)
+		row_pointers[i] = (png_bytep)(image->content + i*image->line_byte);
+	png_read_image(png_ptr, row_pointers);
+	png_read_end(png_ptr, NULL);
+	free(row_pointers);
+
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	fclose(fp);
+	return _apply_decode_opts(image, opts);
+}
+
+fb_image *fb_read_png_image(char *file)
+{
+	return _read_png(file, FB_DECODE_DEFAULT);
+}
+
+/*================== read an image by file header ===============*/
+static fb_image *_load_image(char *file, int opts, int fit_w, int fit_h)
+{
+	unsigned char head[8];
+	int fd, n;
+
+	fd = open(file, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_load_image: open %s error %d\n", file, errno);
+		return NULL;
+	}
+	n = read(fd, head, sizeof(head));
+	close(fd);
+	if(n < 4) return NULL;
+
+	if((head[0] == 0xff)&&(head[1] == 0xd8))
+		return _read_jpeg(file, opts, fit_w, fit_h);
+	if((head[0] == 0x89)&&(head[1] == 'P')&&(head[2] == 'N')&&(head[3] == 'G'))
+		return _read_png(file, opts);
+
+	printf("fb_load_image: unsupported image %s\n", file);
+	return NULL;
+}
+
+fb_image *fb_load_image(char *file, int opts)
+{
+	return _load_image(file, opts, 0, 0);
+}
+
+fb_image *fb_load_image_fit(char *file, int max_w, int max_h)
+{
+	fb_image *image, *fit;
+	int w, h;
+
+	image = _load_image(file, FB_DECODE_DEFAULT, max_w, max_h);
+	if(image == NULL) return NULL;
+	w = image->pixel_w;
+	h = image->pixel_h;
+	_fit_size(&w, &h, max_w, max_h);
+	if((w == image->pixel_w)&&(h == image->pixel_h)) return image;
+	fit = fb_scale_image(image, w, h, FB_FILTER_BOX);
+	fb_free_image(image);
+	return fit;
+}
+
+/*================== pre-decoded image bundle ===============*/
+/* 文件格式: bundle_header, count个bundle_entry, 然后是各图片的像素数据.
+ * 像素数据按行原样存放(fb_image的内存布局), 偏移按64字节对齐,
+ * 加载时直接mmap, 得到的fb_image指向映射内存, 不需要再解码.
+ * 版本2: 名字是相对root的路径, 并记下打包时源文件的mtime. */
+#include <sys/mman.h>
+
+#define BUNDLE_MAGIC	0x44424246 /* "FBBD" */
+#define BUNDLE_VERSION	2
+#define BUNDLE_ALIGN	64
+#define BUNDLE_NAME_MAX	96
+#define BUNDLE_ROOT_MAX	256
+
+typedef struct {
+	int magic;
+	int version;
+	int count;
+	int reserved;
+	char root[BUNDLE_ROOT_MAX]; /*名字相对的目录, 空串表示名字本身就是路径*/
+} bundle_header;
+
+typedef struct {
+	char name[BUNDLE_NAME_MAX]; /*相对root的路径*/
+	int color_type;
+	int pixel_w, pixel_h;
+	int line_byte;
+	int offset; /*像素数据在文件中的偏移*/
+	int size;
+	int palette; /*调色板在文件中的偏移, 没有时为0*/
+	int flags; /*BUNDLE_PALETTE_OPAQUE*/
+	long long mtime; /*打包时源文件的mtime(纳秒), 0表示不知道*/
+} bundle_entry;
+
+#define BUNDLE_PALETTE_OPAQUE	1 /*调色板用到的颜色都不透明*/
+
+struct fb_bundle {
+	char *addr;
+	int size;
+	int count;
+	const char *root;
+	bundle_entry *entries;
+};
+
+fb_bundle *fb_bundle_open(char *file)
+{
+	struct stat st;
+	bundle_header *head;
+	fb_bundle *bundle;
+	char *addr;
+	int fd, i;
+
+	fd = open(file, O_RDONLY);
+	if(fd < 0) {
+		printf("fb_bundle_open: open %s error %d\n", file, errno);
+		return NULL;
+	}
+	if((fstat(fd, &st) < 0)||(st.st_size < (int)sizeof(bundle_header))) {
+		printf("fb_bundle_open: bad file %s\n", file);
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED) {
+		printf("fb_bundle_open: mmap %s error %d\n", file, errno);
+		return NULL;
+	}
+
+	head = (bundle_header *)addr;
+	if((head->magic != BUNDLE_MAGIC)||(head->version != BUNDLE_VERSION)||
+		(head->count < 0)||
+		(head->count > (st.st_size - (int)sizeof(bundle_header))/(int)sizeof(bundle_entry))||
+		(memchr(head->root, '\0', BUNDLE_ROOT_MAX) == NULL))
+		goto bad;
+
+	bundle = (fb_bundle *)malloc(sizeof(fb_bundle));
+	if(bundle == NULL) goto bad;
+	bundle->addr = addr;
+	bundle->size = st.st_size;
+	bundle->count = head->count;
+	bundle->root = head->root;
+	bundle->entries = (bundle_entry *)(head+1);
+
+	for(i=0; i<bundle->count; ++i)
+	{
+		bundle_entry *e = bundle->entries + i;
+		if((e->offset < 0)||(e->size < 0)||(e->offset > bundle->size - e->size)||
+			(fb_color_bytes(e->color_type) == 0)||(e->pixel_w < 0)||(e->pixel_h < 0)||
+			((long long)e->line_byte < (long long)e->pixel_w*fb_color_bytes(e->color_type))||
+			((long long)e->line_byte*e->pixel_h > e->size)||
+			((e->color_type == FB_COLOR_PALETTE_8)&&
+				((e->palette <= 0)||(e->palette > bundle->size - FB_PALETTE_SIZE*4)||(e->palette & 3)))||
+			(memchr(e->name, '\0', BUNDLE_NAME_MAX) == NULL)) {
+			free(bundle);
+			goto bad;
+		}
+	}
+	return bundle;
+
+bad:
+	printf("fb_bundle_open: %s is not a valid bundle\n", file);
+	munmap(addr, st.st_size);
+	return NULL;
+}
+
+void fb_bundle_close(fb_bundle *bundle)
+{
+	if(bundle == NULL) return;
+	munmap(bundle->addr, bundle->size);
+	free(bundle);
+}
+
+static bundle_entry *_bundle_find(fb_bundle *bundle, const char *name)
+{
+	int i;
+	for(i=0; i<bundle->count; ++i)
+	{
+		if(strcmp(bundle->entries[i].name, name) == 0)
+			return bundle->entries + i;
+	}
+	return NULL;
+}
+
+static fb_image *_bundle_image(fb_bundle *bundle, bundle_entry *e)
+{
+	fb_image *image = (fb_image *)malloc(sizeof(fb_image));
+	if(image == NULL) return NULL;
+	image->color_type = e->color_type;
+	image->pixel_w = e->pixel_w;
+	image->pixel_h = e->pixel_h;
+	image->line_byte = e->line_byte;
+	image->content = bundle->addr + e->offset;
+	image->flags = FB_IMAGE_VIEW;
+	image->palette = NULL;
+	image->palette_opaque = 0;
+	if(e->color_type == FB_COLOR_PALETTE_8) {
+		image->palette = (int *)(bundle->addr + e->palette);
+		image->palette_opaque = (e->flags & BUNDLE_PALETTE_OPAQUE) != 0;
+	}
+	return image;
+}
+
+fb_image *fb_bundle_get(fb_bundle *bundle, const char *name)
+{
+	bundle_entry *e;
+
+	if((bundle == NULL)||(name == NULL)) return NULL;
+	e = _bundle_find(bundle, name);
+	if(e == NULL) return NULL;
+	return _bundle_image(bundle, e);
+}
+
+int fb_bundle_write(char *file, const char *root, char **names, fb_image **images, const long long *mtimes, int n)
+{
+	static const char zero[BUNDLE_ALIGN];
+	bundle_header head;
+	bundle_entry *entries;
+	FILE *fp;
+	int i, y, offset, pad, err;
+
+	if(root == NULL) root = "";
+	if(strlen(root) >= BUNDLE_ROOT_MAX) {
+		printf("fb_bundle_write: root too long: %s\n", root);
+		return -1;
+	}
+	entries = (bundle_entry *)calloc(n > 0 ? n : 1, sizeof(bundle_entry));
+	if(entries == NULL) return -1;
+
+	offset = sizeof(bundle_header) + n*sizeof(bundle_entry);
+	for(i=0; i<n; ++i)
+	{
+		fb_image *img = images[i];
+		int row = img->line_byte;
+		if(strlen(names[i]) >= BUNDLE_NAME_MAX) {
+			printf("fb_bundle_write: name too long: %s\n", names[i]);
+			free(entries);
+			return -1;
+		}
+		strcpy(entries[i].name, names[i]);
+		if(row < img->pixel_w*fb_color_bytes(img->color_type))
+			row = img->pixel_w*fb_color_bytes(img->color_type);
+		offset = (offset + BUNDLE_ALIGN-1) & ~(BUNDLE_ALIGN-1);
+		entries[i].color_type = img->color_type;
+		entries[i].pixel_w = img->pixel_w;
+		entries[i].pixel_h = img->pixel_h;
+		entries[i].line_byte = row;
+		entries[i].offset = offset;
+		entries[i].size = row*img->pixel_h;
+		entries[i].mtime = mtimes ? mtimes[i] : 0;
+		offset += entries[i].size;
+		if(img->color_type == FB_COLOR_PALETTE_8) {
+			offset = (offset + 3) & ~3;
+			entries[i].palette = offset;
+			if(img->palette_opaque) entries[i].flags |= BUNDLE_PALETTE_OPAQUE;
+			offset += FB_PALETTE_SIZE*4;
+		}
+	}
+
+	fp = fopen(file, "wb");
+	if(fp == NULL) {
+		printf("fb_bundle_write: open %s error %d\n", file, errno);
+		free(entries);
+		return -1;
+	}
+	memset(&head, 0, sizeof(head));
+	head.magic = BUNDLE_MAGIC;
+	head.version = BUNDLE_VERSION;
+	head.count = n;
+	strcpy(head.root, root);
+	fwrite(&head, sizeof(head), 1, fp);
+	fwrite(entries, sizeof(bundle_entry), n, fp);
+
+	offset = sizeof(bundle_header) + n*sizeof(bundle_entry);
+	for(i=0; i<n; ++i)
+	{
+		fb_image *img = images[i];
+		pad = entries[i].offset - offset;
+		fwrite(zero, 1, pad, fp);
+		for(y=0; y<img->pixel_h; ++y)
+			fwrite(img->content + y*img->line_byte, 1, entries[i].line_byte, fp);
+		offset = entries[i].offset + entries[i].size;
+		if(img->color_type == FB_COLOR_PALETTE_8) {
+			fwrite(zero, 1, entries[i].palette - offset, fp);
+			fwrite(img->palette, 4, FB_PALETTE_SIZE, fp);
+			offset = entries[i].palette + FB_PALETTE_SIZE*4;
+		}
+	}
+
+	free(entries);
+	err = ferror(fp); /*磁盘满等写了一半的情况, fwrite的返回值不再一个个检查*/
+	if((fclose(fp) != 0)||err) {
+		printf("fb_bundle_write: write %s error %d\n", file, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*================== thumbnail cache ===============*/
+/* 每个缩略图存成只有一项的bundle文件, 文件名是(路径,大小,mtime,尺寸)的FNV-1a散列,
+ * 原图修改后散列变化, 旧文件不再被用到. 命中时只需mmap, 不用解码. */
+
+#define THUMB_NAME	"thumb"
+
+typedef struct {
+	fb_image image; /*必须在最前面, fb_thumb_release据此找回整个结构*/
+	fb_bundle *bundle; /*image指向bundle的映射*/
+	fb_image *owned; /*写缓存失败时直接用解码出来的图片*/
+} thumb_image;
+
+static unsigned long long _fnv1a(unsigned long long h, const void *data, int n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	while(n-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+fb_image *fb_thumb_acquire(char *file, int w, int h, const char *cache_dir)
+{
+	struct stat st;
+	unsigned long long key;
+	long long size, mtime;
+	char path[512], tmp[560];
+	char *names[1] = {THUMB_NAME};
+	fb_image *image, *view;
+	thumb_image *thumb;
+
+	if((w <= 0)||(h <= 0)||(stat(file, &st) < 0)) return NULL;
+	size = st.st_size;
+	mtime = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+	key = _fnv1a(0xcbf29ce484222325ULL, file, strlen(file));
+	key = _fnv1a(key, &size, sizeof(size));
+	key = _fnv1a(key, &mtime, sizeof(mtime));
+	key = _fnv1a(key, &w, sizeof(w));
+	key = _fnv1a(key, &h, sizeof(h));
+	snprintf(path, sizeof(path), "%s/%016llx.fbb", cache_dir, key);
+
+	thumb = (thumb_image *)calloc(1, sizeof(thumb_image));
+	if(thumb == NULL) return NULL;
+	if(access(path, R_OK) == 0)
+		thumb->bundle = fb_bundle_open(path);
+	if(thumb->bundle == NULL) {
+		image = fb_load_image_fit(file, w, h);
+		if(image == NULL) {
+			free(thumb);
+			return NULL;
+		}
+		/*先写临时文件再改名, 其它进程不会读到写了一半的缩略图*/
+		mkdir(cache_dir, 0755);
+		snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+		if((fb_bundle_write(tmp, NULL, names, &image, NULL, 1) == 0)&&(rename(tmp, path) == 0)) {
+			thumb->bundle = fb_bundle_open(path);
+		} else {
+			unlink(tmp);
+		}
+		if(thumb->bundle != NULL) {
+			fb_free_image(image);
+		} else {
+			thumb->owned = image;
+			thumb->image = *image;
+			return &thumb->image;
+		}
+	}
+	view = fb_bundle_get(thumb->bundle, THUMB_NAME);
+	if(view == NULL) {
+		fb_bundle_close(thumb->bundle);
+		free(thumb);
+		return NULL;
+	}
+	thumb->image = *view;
+	fb_free_image(view);
+	return &thumb->image;
+}
+
+void fb_thumb_release(fb_image *image)
+{
+	thumb_image *thumb = (thumb_image *)image;
+	if(thumb == NULL) return;
+	fb_bundle_close(thumb->bundle);
+	fb_free_image(thumb->owned);
+	free(thumb);
+}
+
+/*================== shared image cache ===============*/
+/* 以 路径+mtime+解码选项 为键共享解码结果, 引用计数为0的项按LRU淘汰.
+ * 链表头是最近使用的项, 条目数量很少, 线性查找即可. */
+
+typedef struct cache_entry {
+	struct cache_entry *prev, *next;
+	char *path;
+	struct timespec mtime;
+	int opts;
+	int refs;
+	int bytes;
+	fb_image *image;
+} cache_entry;
+
+#define IMAGE_CACHE_BUDGET_DEFAULT	(16*1024*1024)
+
+#define CACHE_BUNDLE_MAX	4
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry *cache_head, *cache_tail;
+static fb_image_cache_stat cache_stat = {0, 0, 0, 0, 0, IMAGE_CACHE_BUDGET_DEFAULT};
+static fb_bundle *cache_bundles[CACHE_BUNDLE_MAX];
+
+static void _cache_unlink(cache_entry *e)
+{
+	if(e->prev) e->prev->next = e->next; else cache_head = e->next;
+	if(e->next) e->next->prev = e->prev; else cache_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void _cache_push_front(cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache_head;
+	if(cache_head) cache_head->prev = e; else cache_tail = e;
+	cache_head = e;
+}
+
+/*淘汰不再被引用的项, 直到总字节数不超过预算; 调用者持有cache_lock*/
+static void _cache_trim(void)
+{
+	cache_entry *e, *prev;
+	for(e = cache_tail; e && (cache_stat.bytes > cache_stat.budget); e = prev)
+	{
+		prev = e->prev;
+		if(e->refs > 0) continue;
+		_cache_unlink(e);
+		cache_stat.bytes -= e->bytes;
+		cache_stat.entries--;
+		cache_stat.evictions++;
+		fb_free_image(e->image);
+		free(e->path);
+		free(e);
+	}
+}
+
+static cache_entry *_cache_find(const char *path, struct timespec *mtime, int opts)
+{
+	cache_entry *e;
+	for(e = cache_head; e; e = e->next)
+	{
+		if((e->opts == opts)&&
+			(e->mtime.tv_sec == mtime->tv_sec)&&
+			(e->mtime.tv_nsec == mtime->tv_nsec)&&
+			(strcmp(e->path, path) == 0))
+			return e;
+	}
+	return NULL;
+}
+
+void fb_image_cache_mount(fb_bundle *bundle)
+{
+	int i;
+	if(bundle == NULL) return;
+	pthread_mutex_lock(&cache_lock);
+	for(i=0; i<CACHE_BUNDLE_MAX; ++i)
+	{
+		if(cache_bundles[i] == NULL) {
+			cache_bundles[i] = bundle;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if(i == CACHE_BUNDLE_MAX) printf("mount bundle too many\n");
+}
+
+/*在已挂载的bundle中按完整路径(root/name)查找, 找到返回所在的bundle*/
+static fb_bundle *_cache_find_bundle(const char *path, bundle_entry **entry)
+{
+	int i, n;
+
+	for(i=0; i<CACHE_BUNDLE_MAX; ++i)
+	{
+		fb_bundle *bundle = cache_bundles[i];
+		const char *name = path;
+		if(bundle == NULL) break;
+		n = strlen(bundle->root);
+		if(n > 0) {
+			if(strncmp(path, bundle->root, n) != 0) continue;
+			if(bundle->root[n-1] != '/') {
+				if(path[n] != '/') continue;
+				n++;
+			}
+			name = path + n;
+		}
+		*entry = _bundle_find(bundle, name);
+		if(*entry != NULL) return bundle;
+	}
+	return NULL;
+}
+
+fb_image *fb_image_acquire_opt(char *path, int opts)
+{
+	struct stat st;
+	cache_entry *e;
+	fb_image *image;
+	fb_bundle *bundle = NULL;
+	bundle_entry *entry = NULL;
+
+	/*bundle中的图片已按打包时选定的格式解码好, 不再看解码选项; mtime记为0.
+	  源文件还在, 且打包之后改过时, 不用bundle里的旧图*/
+	pthread_mutex_lock(&cache_lock);
+	bundle = _cache_find_bundle(path, &entry);
+	pthread_mutex_unlock(&cache_lock);
+	if((bundle != NULL)&&(entry->mtime != 0)&&(stat(path, &st) == 0)&&
+		(st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec != entry->mtime))
+		bundle = NULL;
+	if(bundle != NULL) {
+		memset(&st, 0, sizeof(st));
+	} else if(stat(path, &st) < 0) {
+		printf("fb_image_acquire: stat %s error %d\n", path, errno);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	e = _cache_find(path, &st.st_mtim, opts);
+	if(e != NULL) {
+		e->refs++;
+		_cache_unlink(e);
+		_cache_push_front(e);
+		cache_stat.hits++;
+		pthread_mutex_unlock(&cache_lock);
+		return e->image;
+	}
+	cache_stat.misses++;
+	pthread_mutex_unlock(&cache_lock);
+
+	/*解码时不持锁, 其他线程可以同时解码别的图片*/
+	if(bundle != NULL)
+		image = _bundle_image(bundle, entry);
+	else
+		image = fb_load_image(path, opts);
+	if(image == NULL) return NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	e = _cache_find(path, &st.st_mtim, opts);
+	if(e != NULL) { /*另一个线程抢先放入了同一张图片*/
+		e->refs++;
+		pthread_mutex_unlock(&cache_lock);
+		fb_free_image(image);
+		return e->image;
+	}
+	e = (cache_entry *)calloc(1, sizeof(cache_entry));
+	if((e == NULL)||((e->path = strdup(path)) == NULL)) {
+		pthread_mutex_unlock(&cache_lock);
+		free(e);
+		return image; /*不进缓存, fb_image_release时直接释放*/
+	}
+	e->mtime = st.st_mtim;
+	e->opts = opts;
+	e->refs = 1;
+	e->image = image;
+	e->bytes = sizeof(fb_image);
+	if(bundle == NULL) e->bytes += image->line_byte*image->pixel_h;
+	_cache_push_front(e);
+	cache_stat.entries++;
+	cache_stat.bytes += e->bytes;
+	_cache_trim();
+	pthread_mutex_unlock(&cache_lock);
 	return image;
 }
 
+fb_image *fb_image_acquire(char *path)
+{
+	return fb_image_acquire_opt(path, FB_DECODE_DEFAULT);
+}
+
+void fb_image_release(fb_image *image)
+{
+	cache_entry *e;
+	if(image == NULL) return;
+
+	pthread_mutex_lock(&cache_lock);
+	for(e = cache_head; e; e = e->next)
+	{
+		if(e->image == image) break;
+	}
+	if(e == NULL) {
+		pthread_mutex_unlock(&cache_lock);
+		fb_free_image(image); /*不是缓存中的图片*/
+		return;
+	}
+	if(e->refs > 0) e->refs--;
+	if(e->refs == 0) _cache_trim();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void fb_image_cache_set_budget(int bytes)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_stat.budget = (bytes < 0) ? 0 : bytes;
+	_cache_trim();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void fb_image_cache_get_stat(fb_image_cache_stat *stat)
+{
+	if(stat == NULL) return;
+	pthread_mutex_lock(&cache_lock);
+	*stat = cache_stat;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*================== load assets in parallel ===============*/
+
+typedef struct {
+	fb_asset *assets;
+	fb_asset_func ready;
+	int failed;
+} asset_batch;
+
+static void _load_asset(int i, void *arg)
+{
+	fb_asset *asset = ((asset_batch *)arg)->assets + i;
+	asset->image = NULL;
+	if(asset->type == FB_ASSET_IMAGE)
+		asset->image = fb_image_acquire_opt(asset->path, asset->opts);
+	else if(asset->type == FB_ASSET_FONT)
+		font_init(asset->path);
+}
+
+static void _asset_done(int i, void *arg)
+{
+	asset_batch *batch = (asset_batch *)arg;
+	fb_asset *asset = batch->assets + i;
+	if((asset->type == FB_ASSET_IMAGE)&&(asset->image == NULL))
+		batch->failed++;
+	if(batch->ready) batch->ready(asset);
+}
+
+int fb_load_assets(fb_asset *assets, int n, fb_asset_func ready)
+{
+	asset_batch batch;
+	batch.assets = assets;
+	batch.ready = ready;
+	batch.failed = 0;
+	task_parallel(n, _load_asset, _asset_done, &batch);
+	return batch.failed;
+}
+
 /*================== read a font image ===============*/
 
 #include <ft2build.h>
@@ -336,12 +1330,14 @@ fb_image* fb_read_font_image(const char *text, int pixel_size, fb_font_info *inf
 
 	fb_image* image;
 	/*when ucs4 == 0x20 (blank), the bitmap.width/rows/pitch is 0*/
-	image = fb_new_image(FB_COLOR_ALPHA_8, slot->bitmap.width, slot->bitmap.rows, slot->bitmap.pitch);
+	image = fb_new_image(FB_COLOR_ALPHA_8, slot->bitmap.width, slot->bitmap.rows, 0);
 	if(image == NULL){
 		printf("fb_new_image(\"%s\", %d,%d,%d) failed\n", text, slot->bitmap.width, slot->bitmap.rows, slot->bitmap.pitch);
 		return NULL;
 	}
-	memcpy(image->content, slot->bitmap.buffer, slot->bitmap.rows * slot->bitmap.pitch);
+	int row;
+	for(row = 0; row < slot->bitmap.rows; ++row)
+		memcpy(image->content + row*image->line_byte, slot->bitmap.buffer + row*slot->bitmap.pitch, slot->bitmap.width);
 
 	sinfo.advance_x = slot->advance.x >> 6;
 	sinfo.left = slot->bitmap_left;
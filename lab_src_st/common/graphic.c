@@ -7,6 +7,10 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 
 
 static int LCD_FB_FD;
@@ -14,6 +18,8 @@ static int *LCD_FB_BUF = NULL;
 static int *LCD_FB_FRONT, *LCD_FB_BACK;
 struct fb_var_screeninfo LCD_FB_VAR;
 static int DRAW_BUF[SCREEN_WIDTH*SCREEN_HEIGHT];
+static fb_image SCREEN_IMAGE = {FB_COLOR_RGB_8880, SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_WIDTH*4,
+	(char *)DRAW_BUF, FB_IMAGE_VIEW, NULL, 0}; /*DRAW_BUF的图片视图*/
 
 static struct area {
 	int x1, x2, y1, y2;
@@ -34,9 +40,12 @@ void fb_init(char *dev)
 
 	if(LCD_FB_BUF != NULL) return; /*already done*/
 
+	AREA_SET_EMPTY(&update_area);
+	if(getenv("FB_LATENCY_OVERLAY") != NULL) fb_latency_overlay(1);
+
 	//First: Open the device
 	if((fd = open(dev, O_RDWR)) < 0){
-		printf("Unable to open framebuffer %s, errno = %d\n", dev, errno);
+		printf("Unable to open framebuffer %s, errno = %d, drawing headless\n", dev, errno);
 		return;
 	}
 	if(ioctl(fd, FBIOGET_FSCREENINFO, &fb_fix) < 0){
@@ -76,8 +85,6 @@ void fb_init(char *dev)
 	LCD_FB_BACK = addr + fb_var.xres*fb_var.yres;
 	LCD_FB_VAR = fb_var;
 
-	//set empty
-	AREA_SET_EMPTY(&update_area);
 	return;
 }
 
@@ -112,11 +119,23 @@ static int _check_area(struct area *pa)
 	return 0;
 }
 
+static int damage_num;
+static void _compose_layers(void);
+static void _latency_overlay_update(void);
+static void _latency_present(int presented);
+
 void fb_update(void)
 {
-	if(_check_area(&update_area) == 0) return; //is empty
-	_copy_area(LCD_FB_FRONT, DRAW_BUF, &update_area);
+	int app_drawn = _check_area(&update_area) || (damage_num > 0); /*叠加层自己的刷新不算显示了输入*/
+	_latency_overlay_update();
+	_compose_layers(); /*先把变化过的图层合成进来*/
+	if(_check_area(&update_area) == 0) { //is empty
+		_latency_present(0);
+		return;
+	}
+	if(LCD_FB_FRONT != NULL) _copy_area(LCD_FB_FRONT, DRAW_BUF, &update_area); //没有framebuffer时只在DRAW_BUF里画
 	AREA_SET_EMPTY(&update_area); //set empty
+	_latency_present(app_drawn);
 	return;
 }
 
@@ -133,72 +152,219 @@ static void * _begin_draw(int x, int y, int w, int h)
 	return DRAW_BUF;
 }
 
-void fb_draw_pixel(int x, int y, int color)
+/*============================ span kernels ============================*/
+
+typedef uint64_t __attribute__((may_alias)) pixel_pair; /*一次写两个像素, 可以和int32_t混用*/
+
+/*横线: 先对齐到8字节, 中间每次写两个像素*/
+static void _fill_span(int32_t *dst, int n, int color)
 {
-	if(x<0 || y<0 || x>=SCREEN_WIDTH || y>=SCREEN_HEIGHT) return;
-	int *buf = _begin_draw(x,y,1,1);
-/*---------------------------------------------------*/
-	*(buf + y*SCREEN_WIDTH + x) = color;
-/*---------------------------------------------------*/
-	return;
+	if ((n > 0) && ((uintptr_t)dst & 4))
+	{
+		*dst++ = color;
+		n--;
+	}
+	pixel_pair pair = (uint32_t)color * 0x100000001ULL;
+	pixel_pair *d = (pixel_pair *)dst;
+	for (int i = 0; i < n / 2; i++)
+	{
+		d[i] = pair;
+	}
+	if (n & 1)
+	{
+		dst[n - 1] = color;
+	}
 }
 
-void fb_draw_rect(int x, int y, int w, int h, int color)
+/*实心矩形: 竖线逐行写一个像素, 否则填好第一行后其余行整行复制*/
+static void _fill_rect(char *dst, int line_byte, int w, int h, int color)
 {
-	if(x < 0) { w += x; x = 0;}
-	if(x+w > SCREEN_WIDTH) { w = SCREEN_WIDTH-x;}
-	if(y < 0) { h += y; y = 0;}
-	if(y+h >SCREEN_HEIGHT) { h = SCREEN_HEIGHT-y;}
-	if(w<=0 || h<=0) return;
-	int32_t *buf = _begin_draw(x,y,w,h);
-	/*---------------------------------------------------*/
-	// printf("you need implement fb_draw_rect()\n"); exit(0);
-	// Add your code here
-	int32_t *rect_start = buf + x + y * SCREEN_WIDTH;
-	int32_t *line_start = rect_start;
-	if (h > 0)
+	if (w == 1)
 	{
-		for (int xx = 0; xx < w; xx++)
+		for (int row = 0; row < h; row++, dst += line_byte)
 		{
-			line_start[xx] = color;
+			*(int32_t *)dst = color;
 		}
+		return;
 	}
-	line_start += SCREEN_WIDTH;
-	for (int yy = 1; yy < h; yy++)
+	_fill_span((int32_t *)dst, w, color);
+	for (int row = 1; row < h; row++)
 	{
-		memcpy(line_start, rect_start, sizeof(int32_t) * w);
-		line_start += SCREEN_WIDTH;
+		memcpy(dst + row * line_byte, dst, w * 4);
 	}
-	/*---------------------------------------------------*/
-	return;
 }
 
-void fb_draw_line(int x1, int y1, int x2, int y2, int color)
+/*把32位的tile平铺到目标图片的(x,y,w,h), 图案的左上角对齐目标图片的(ax,ay).
+  一行内先复制一个周期, 再成倍复制已经写好的部分; tile高度以下的行复制上面的行*/
+static void _fill_pattern(fb_image *target, int x, int y, int w, int h, const fb_image *tile, int ax, int ay)
+{
+	int tw = tile->pixel_w, th = tile->pixel_h;
+	int line_byte = target->line_byte;
+	int tx0 = ((x - ax) % tw + tw) % tw;
+	for (int row = 0; row < h; row++)
+	{
+		int32_t *dst = (int32_t *)(target->content + (y + row) * line_byte) + x;
+		if (row >= th)
+		{
+			memcpy(dst, (char *)dst - th * line_byte, w * 4);
+			continue;
+		}
+		const int32_t *src = (const int32_t *)(tile->content + ((y + row - ay) % th + th) % th * tile->line_byte);
+		int done = (tw - tx0 < w) ? tw - tx0 : w;
+		memcpy(dst, src + tx0, done * 4);
+		if (done < w)
+		{
+			int n = (tw < w - done) ? tw : w - done;
+			memcpy(dst + done, src, n * 4);
+			done += n;
+		}
+		while (done < w)
+		{
+			int period = done - done % tw; /*前面已写好的整数个周期*/
+			int n = (period < w - done) ? period : w - done;
+			memcpy(dst + done, dst + done - period, n * 4);
+			done += n;
+		}
+	}
+}
+
+/*============================ drawing context ============================*/
+
+static fb_ctx screen_ctx = {&SCREEN_IMAGE, 0, 0, 1, {{0, 0, SCREEN_WIDTH, SCREEN_HEIGHT}}};
+
+fb_ctx *fb_screen_ctx(void)
+{
+	return &screen_ctx;
+}
+
+/*target必须是32位图片, 否则裁剪区为空, 什么也画不上; 裁剪区初始为整张图片, 原点为(0,0)*/
+void fb_ctx_init(fb_ctx *ctx, fb_image *target)
+{
+	int ok = (target != NULL) && (fb_color_bytes(target->color_type) == 4);
+	ctx->target = target;
+	ctx->ox = ctx->oy = 0;
+	ctx->depth = 1;
+	ctx->clip[0].x = ctx->clip[0].y = 0;
+	ctx->clip[0].w = ok ? target->pixel_w : 0;
+	ctx->clip[0].h = ok ? target->pixel_h : 0;
+}
+
+/*之后的坐标都相对于目标图片的(x,y)*/
+void fb_ctx_set_origin(fb_ctx *ctx, int x, int y)
+{
+	ctx->ox = x;
+	ctx->oy = y;
+}
+
+/*(x,y,w,h)是相对原点的坐标, 与当前裁剪区求交后压栈; 栈满返回-1*/
+int fb_ctx_push_clip(fb_ctx *ctx, int x, int y, int w, int h)
+{
+	if(ctx->depth >= FB_CLIP_DEPTH) return -1;
+	fb_rect *c = &ctx->clip[ctx->depth-1];
+	int x1 = x + ctx->ox, y1 = y + ctx->oy;
+	int x2 = x1 + w, y2 = y1 + h;
+	if(x1 < c->x) x1 = c->x;
+	if(y1 < c->y) y1 = c->y;
+	if(x2 > c->x + c->w) x2 = c->x + c->w;
+	if(y2 > c->y + c->h) y2 = c->y + c->h;
+	fb_rect *n = &ctx->clip[ctx->depth++];
+	n->x = x1;
+	n->y = y1;
+	n->w = (x2 > x1) ? x2 - x1 : 0;
+	n->h = (y2 > y1) ? y2 - y1 : 0;
+	return 0;
+}
+
+/*最底层(整张图片)不会被弹出*/
+void fb_ctx_pop_clip(fb_ctx *ctx)
 {
-/*---------------------------------------------------*/
-	// printf("you need implement fb_draw_line()\n"); exit(0);
-	// Add your code here
+	if(ctx->depth > 1) ctx->depth--;
+}
+
+/*把相对原点的矩形转成目标图片坐标并裁剪到当前裁剪区, 返回0表示完全被裁掉*/
+static int _ctx_intersect(fb_ctx *ctx, int *x, int *y, int *w, int *h)
+{
+	fb_rect *c = &ctx->clip[ctx->depth-1];
+	int x1 = *x + ctx->ox, y1 = *y + ctx->oy;
+	int x2 = x1 + *w, y2 = y1 + *h;
+	if(x1 < c->x) x1 = c->x;
+	if(y1 < c->y) y1 = c->y;
+	if(x2 > c->x + c->w) x2 = c->x + c->w;
+	if(y2 > c->y + c->h) y2 = c->y + c->h;
+	if(x1 >= x2 || y1 >= y2) return 0;
+	*x = x1; *y = y1; *w = x2 - x1; *h = y2 - y1;
+	return 1;
+}
+
+/*同上, 画到屏幕时还要记录更新区域*/
+static int _ctx_clip(fb_ctx *ctx, int *x, int *y, int *w, int *h)
+{
+	if(!_ctx_intersect(ctx, x, y, w, h)) return 0;
+	if(ctx->target == &SCREEN_IMAGE) _begin_draw(*x, *y, *w, *h);
+	return 1;
+}
+
+void fb_ctx_draw_pixel(fb_ctx *ctx, int x, int y, int color)
+{
+	int w = 1, h = 1;
+	if(!_ctx_clip(ctx, &x, &y, &w, &h)) return;
+	*(int32_t *)(ctx->target->content + y*ctx->target->line_byte + x*4) = color;
+}
+
+void fb_ctx_draw_rect(fb_ctx *ctx, int x, int y, int w, int h, int color)
+{
+	if(!_ctx_clip(ctx, &x, &y, &w, &h)) return;
+	int line_byte = ctx->target->line_byte;
+	_fill_rect(ctx->target->content + y*line_byte + x*4, line_byte, w, h, color);
+}
+
+void fb_ctx_draw_line(fb_ctx *ctx, int x1, int y1, int x2, int y2, int color)
+{
+	/*先按外接矩形裁剪, 完全在外面就不用逐点判断*/
 	int x = x1 < x2 ? x1 : x2;
 	int y = y1 < y2 ? y1 : y2;
 	// Bresenha 算法
 	int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
-    int dy = abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
-    int err = (dx > dy ? dx : -dy) / 2;
-	int *buf = _begin_draw(x, y, dx, dy);
+	int dy = abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+	int err = (dx > dy ? dx : -dy) / 2;
+	int w = dx + 1, h = dy + 1;
+	if(!_ctx_clip(ctx, &x, &y, &w, &h)) return;
 
-	while (*(buf + y1 * SCREEN_WIDTH + x1) = color, x1 != x2 || y1 != y2)
+	char *buf = ctx->target->content;
+	int line_byte = ctx->target->line_byte;
+	x1 += ctx->ox; y1 += ctx->oy;
+	x2 += ctx->ox; y2 += ctx->oy;
+	for(;;)
 	{
+		if(x1 >= x && x1 < x+w && y1 >= y && y1 < y+h)
+			*(int32_t *)(buf + y1*line_byte + x1*4) = color;
+		if(x1 == x2 && y1 == y2) break;
 		int e2 = err;
-        if (e2 > -dx) { err -= dy; x1 += sx; }
-        if (e2 <  dy) { err += dx; y1 += sy; }
+		if (e2 > -dx) { err -= dy; x1 += sx; }
+		if (e2 <  dy) { err += dx; y1 += sy; }
 	}
-/*---------------------------------------------------*/
-	return;
 }
 
-void fb_draw_image(int x, int y, fb_image *image, int color)
+void fb_draw_pixel(int x, int y, int color)
+{
+	fb_ctx_draw_pixel(&screen_ctx, x, y, color);
+}
+
+void fb_draw_rect(int x, int y, int w, int h, int color)
 {
-	if(image == NULL) return;
+	fb_ctx_draw_rect(&screen_ctx, x, y, w, h, color);
+}
+
+void fb_draw_line(int x1, int y1, int x2, int y2, int color)
+{
+	fb_ctx_draw_line(&screen_ctx, x1, y1, x2, y2, color);
+}
+
+/*把image画到32位的目标图片target的(x,y)处, 裁剪到target范围内; 返回0表示完全在外面,
+  否则实际画到的区域写入area*/
+static int _blit_image(fb_image *target, int x, int y, fb_image *image, int color, fb_rect *area)
+{
+	if(image == NULL) return 0;
 	int ix = 0; // image x
 	int iy = 0; //image y
 	int w = image->pixel_w; //draw width
@@ -207,23 +373,25 @@ void fb_draw_image(int x, int y, fb_image *image, int color)
 	if(x<0) {w+=x; ix-=x; x=0;}
 	if(y<0) {h+=y; iy-=y; y=0;}
 	
-	if(x+w > SCREEN_WIDTH) {
-		w = SCREEN_WIDTH - x;
+	if(x+w > target->pixel_w) {
+		w = target->pixel_w - x;
 	}
-	if(y+h > SCREEN_HEIGHT) {
-		h = SCREEN_HEIGHT - y;
+	if(y+h > target->pixel_h) {
+		h = target->pixel_h - y;
 	}
-	if((w <= 0)||(h <= 0)) return;
+	if((w <= 0)||(h <= 0)) return 0;
+	area->x = x;
+	area->y = y;
+	area->w = w;
+	area->h = h;
 
-	int *buf = _begin_draw(x,y,w,h);
 /*---------------------------------------------------------------*/
-	char *dst = (char *)(buf + y*SCREEN_WIDTH + x);
-	char *src = image->content + iy*image->line_byte + ix*4;
+	char *dst = target->content + y*target->line_byte + x*4;
+	char *src = image->content + iy*image->line_byte + ix*fb_color_bytes(image->color_type);
 /*---------------------------------------------------------------*/
 
-	int alpha;
 	int ww;
-	int screen_line_bytes = SCREEN_WIDTH * 4, image_line_bytes = image->line_byte;
+	int screen_line_bytes = target->line_byte, image_line_bytes = image->line_byte;
 
 	if(image->color_type == FB_COLOR_RGB_8880) /*lab3: jpg*/
 	{
@@ -236,7 +404,7 @@ void fb_draw_image(int x, int y, fb_image *image, int color)
 			dst += screen_line_bytes;
 			src += image_line_bytes;
 		}
-		return;
+		return 1;
 	}
 
 	if(image->color_type == FB_COLOR_RGBA_8888) /*lab3: png*/
@@ -272,10 +440,10 @@ void fb_draw_image(int x, int y, fb_image *image, int color)
 					p[2] += (((R1 - p[2]) * alpha) >> 8);
 				}
 			}
-			src_start += image->pixel_w;
-			dst_start += SCREEN_WIDTH;
+			src_start += image_line_bytes / 4;
+			dst_start += screen_line_bytes / 4;
 		}
-		return;
+		return 1;
 	}
 
 	if(image->color_type == FB_COLOR_ALPHA_8) /*lab3: font*/
@@ -309,28 +477,149 @@ void fb_draw_image(int x, int y, fb_image *image, int color)
 					p[2] += (((R1 - p[2]) * alpha) >> 8);
 				}
 			}
-			src_start += image->pixel_w;
-			dst_start += SCREEN_WIDTH;
+			src_start += image_line_bytes;
+			dst_start += screen_line_bytes / 4;
 		}
-		return;
+		return 1;
+	}
+	if(image->color_type == FB_COLOR_RGB_565) /*16位: 展开成32位后写入*/
+	{
+		for (int i = 0; i < h; i++)
+		{
+			unsigned short *s16 = (unsigned short *)(src + i * image_line_bytes);
+			unsigned int *d32 = (unsigned int *)(dst + i * screen_line_bytes);
+			for (int j = 0; j < w; j++)
+			{
+				d32[j] = FB_RGB565_TO_COLOR(s16[j]);
+			}
+		}
+		return 1;
+	}
+
+	if(image->color_type == FB_COLOR_GRAY_8) /*灰度: g -> 0xffgggggg*/
+	{
+		for (int i = 0; i < h; i++)
+		{
+			unsigned char *s8 = (unsigned char *)(src + i * image_line_bytes);
+			unsigned int *d32 = (unsigned int *)(dst + i * screen_line_bytes);
+			for (int j = 0; j < w; j++)
+			{
+				d32[j] = 0xff000000 | (s8[j] * 0x010101);
+			}
+		}
+		return 1;
+	}
+
+	if(image->color_type == FB_COLOR_PALETTE_8) /*调色板: 查表, 调色板全不透明时直接写*/
+	{
+		const unsigned int *pal = (const unsigned int *)image->palette;
+		int opaque = image->palette_opaque;
+		for (int i = 0; i < h; i++)
+		{
+			unsigned char *s8 = (unsigned char *)(src + i * image_line_bytes);
+			unsigned int *d32 = (unsigned int *)(dst + i * screen_line_bytes);
+			if (opaque)
+			{
+				for (int j = 0; j < w; j++)
+				{
+					d32[j] = pal[s8[j]];
+				}
+				continue;
+			}
+			for (int j = 0; j < w; j++)
+			{
+				unsigned int c = pal[s8[j]];
+				unsigned int a = c >> 24;
+				if (a == 0)
+				{
+					continue;
+				}
+				if (a == 255)
+				{
+					d32[j] = c;
+					continue;
+				}
+				unsigned int d = d32[j];
+				unsigned int rb = (((c & 0xff00ff) * a + (d & 0xff00ff) * (256 - a)) >> 8) & 0xff00ff;
+				unsigned int g = (((c & 0x00ff00) * a + (d & 0x00ff00) * (256 - a)) >> 8) & 0x00ff00;
+				d32[j] = (d & 0xff000000) | rb | g;
+			}
+		}
+		return 1;
 	}
 /*---------------------------------------------------------------*/
-	return;
+	return 1;
 }
 
-void fb_draw_border(int x, int y, int w, int h, int color)
+void fb_ctx_draw_image(fb_ctx *ctx, int x, int y, fb_image *image, int color)
+{
+	fb_rect *c = &ctx->clip[ctx->depth-1];
+	if(c->w <= 0 || c->h <= 0) return;
+	fb_image view = *ctx->target; /*当前裁剪区的视图*/
+	view.content += c->y*view.line_byte + c->x*4;
+	view.pixel_w = c->w;
+	view.pixel_h = c->h;
+	view.flags = FB_IMAGE_VIEW;
+	fb_rect area;
+	if(_blit_image(&view, x+ctx->ox-c->x, y+ctx->oy-c->y, image, color, &area)
+		&& ctx->target == &SCREEN_IMAGE)
+		_begin_draw(area.x+c->x, area.y+c->y, area.w, area.h);
+}
+
+void fb_draw_image(int x, int y, fb_image *image, int color)
+{
+	fb_ctx_draw_image(&screen_ctx, x, y, image, color);
+}
+
+/*RGB_8880的tile整行复制, 其它格式逐块用fb_ctx_draw_image画, 按格式混合*/
+void fb_ctx_fill_pattern(fb_ctx *ctx, const fb_rect *rect, fb_image *tile)
+{
+	fb_rect r = {-ctx->ox, -ctx->oy, ctx->target->pixel_w, ctx->target->pixel_h};
+	if (rect != NULL) r = *rect;
+	if ((tile == NULL) || (tile->pixel_w <= 0) || (tile->pixel_h <= 0)) return;
+	if (tile->color_type != FB_COLOR_RGB_8880)
+	{
+		int tw = tile->pixel_w, th = tile->pixel_h;
+		int x0 = r.x - ((r.x % tw) + tw) % tw, y0 = r.y - ((r.y % th) + th) % th;
+		if (fb_ctx_push_clip(ctx, r.x, r.y, r.w, r.h) < 0) return;
+		for (int y = y0; y < r.y + r.h; y += th)
+		{
+			for (int x = x0; x < r.x + r.w; x += tw)
+			{
+				fb_ctx_draw_image(ctx, x, y, tile, 0);
+			}
+		}
+		fb_ctx_pop_clip(ctx);
+		return;
+	}
+	int x = r.x, y = r.y, w = r.w, h = r.h;
+	if (!_ctx_clip(ctx, &x, &y, &w, &h)) return;
+	_fill_pattern(ctx->target, x, y, w, h, tile, ctx->ox, ctx->oy);
+}
+
+void fb_fill_pattern(const fb_rect *rect, fb_image *tile)
+{
+	fb_ctx_fill_pattern(&screen_ctx, rect, tile);
+}
+
+void fb_ctx_draw_border(fb_ctx *ctx, int x, int y, int w, int h, int color)
 {
 	if(w<=0 || h<=0) return;
-	fb_draw_rect(x, y, w, 1, color);
+	fb_ctx_draw_rect(ctx, x, y, w, 1, color);
 	if(h > 1) {
-		fb_draw_rect(x, y+h-1, w, 1, color);
-		fb_draw_rect(x, y+1, 1, h-2, color);
-		if(w > 1) fb_draw_rect(x+w-1, y+1, 1, h-2, color);
+		fb_ctx_draw_rect(ctx, x, y+h-1, w, 1, color);
+		fb_ctx_draw_rect(ctx, x, y+1, 1, h-2, color);
+		if(w > 1) fb_ctx_draw_rect(ctx, x+w-1, y+1, 1, h-2, color);
 	}
 }
 
+void fb_draw_border(int x, int y, int w, int h, int color)
+{
+	fb_ctx_draw_border(&screen_ctx, x, y, w, h, color);
+}
+
 /** draw a text string **/
-void fb_draw_text(int x, int y, char *text, int font_size, int color)
+void fb_ctx_draw_text(fb_ctx *ctx, int x, int y, char *text, int font_size, int color)
 {
 	fb_image *img;
 	fb_font_info info;
@@ -340,7 +629,7 @@ void fb_draw_text(int x, int y, char *text, int font_size, int color)
 	{
 		img = fb_read_font_image(text+i, font_size, &info);
 		if(img == NULL) break;
-		fb_draw_image(x+info.left, y-info.top, img, color);
+		fb_ctx_draw_image(ctx, x+info.left, y-info.top, img, color);
 		fb_free_image(img);
 
 		x += info.advance_x;
@@ -349,35 +638,39 @@ void fb_draw_text(int x, int y, char *text, int font_size, int color)
 	return;
 }
 
+void fb_draw_text(int x, int y, char *text, int font_size, int color)
+{
+	fb_ctx_draw_text(&screen_ctx, x, y, text, font_size, color);
+}
+
 // draw a straight line with offerd direction (1 accord with vertical and 0 with horizonal)
-void fb_draw_straight_line(int x, int y, int len, int direction, int color)
+void fb_ctx_draw_straight_line(fb_ctx *ctx, int x, int y, int len, int direction, int color)
 {
 	if (direction == 1)
 	{
-		for (int yy = 0; yy < len; yy++)
-		{
-			fb_draw_pixel(x, y + yy, color);
-		}
+		fb_ctx_draw_rect(ctx, x, y, 1, len, color);
 	}
 	else
 	{
-		for (int xx = 0; xx < len; xx++)
-		{
-			fb_draw_pixel(x + xx, y, color);
-		}
+		fb_ctx_draw_rect(ctx, x, y, len, 1, color);
 	}
 	return;
 }
 
+void fb_draw_straight_line(int x, int y, int len, int direction, int color)
+{
+	fb_ctx_draw_straight_line(&screen_ctx, x, y, len, direction, color);
+}
+
 // draw a round with offered radius
-void fb_draw_round(int x, int y, int r, int color)
+void fb_ctx_draw_round(fb_ctx *ctx, int x, int y, int r, int color)
 {
 	/*上半球*/
 	int xi = x, yi = y - r;	// 当前迭代的点
 	int offset_x = 0, offset_y = r; // 当前迭代的点到中轴线的距离
 	while(offset_y >= 0)
 	{
-		fb_draw_straight_line(xi, yi, 1 + 2 * offset_x, 0, color);
+		fb_ctx_draw_straight_line(ctx, xi, yi, 1 + 2 * offset_x, 0, color);
 		xi--;
 		if ((xi - x) * (xi - x) + (yi - y) * (yi - y) - r * r < 0)
 		{
@@ -397,7 +690,7 @@ void fb_draw_round(int x, int y, int r, int color)
 	offset_x = 0, offset_y = r; // 当前迭代的点到中轴线的距离
 	while(offset_y >= 0)
 	{
-		fb_draw_straight_line(xi, yi, 1 + 2 * offset_x, 0, color);
+		fb_ctx_draw_straight_line(ctx, xi, yi, 1 + 2 * offset_x, 0, color);
 		xi--;
 		if ((xi - x) * (xi - x) + (yi - y) * (yi - y) - r * r < 0)
 		{
@@ -415,129 +708,1885 @@ void fb_draw_round(int x, int y, int r, int color)
 	return;
 }
 
-void fb_draw_thick_line(int x1, int y1, int x2, int y2, int r, int color)
+void fb_draw_round(int x, int y, int r, int color)
 {
-	int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
-	int dy = abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
-	int err = (dx > dy ? dx : -dy) / 2;
+	fb_ctx_draw_round(&screen_ctx, x, y, r, color);
+}
 
-	fb_draw_pixel(x1, y1, color);
+/*============================ capsule rasterizer ============================*/
 
-	while (x1 != x2 || y1 != y2)
+/*胶囊(线段扩张r)与一行y的交集[*l, *r], 空时返回0. 胶囊是凸的, 所以就是两端圆盘和中间
+  带状区域各自交集的并*/
+static int _capsule_span(float ax, float ay, float ex, float ey, float len, float r, float y, float *l, float *rr)
+{
+	float lo = 1e30f, hi = -1e30f;
+	float dy = y - ay;
+	for (int k = 0; k < 2; k++) /*两端的圆盘*/
 	{
-		int e2 = err;
-		if (e2 > -dx)
+		float cy = dy - k * ey;
+		if (cy * cy <= r * r)
+		{
+			float h = sqrtf(r * r - cy * cy);
+			float cx = ax + k * ex;
+			if (cx - h < lo) lo = cx - h;
+			if (cx + h > hi) hi = cx + h;
+		}
+	}
+	if (len > 0) /*带状区域: 投影在线段上, 且到直线的距离不超过r*/
+	{
+		float bl = -1e30f, br = 1e30f;
+		float s0 = -dy * ey, s1 = len * len - dy * ey; /*(x-ax)*ex的范围*/
+		float c0 = ex * dy - r * len, c1 = ex * dy + r * len; /*(x-ax)*ey的范围*/
+		if (ex != 0)
+		{
+			float t0 = s0 / ex, t1 = s1 / ex;
+			bl = ax + (t0 < t1 ? t0 : t1);
+			br = ax + (t0 < t1 ? t1 : t0);
+		}
+		else if (s0 > 0 || s1 < 0)
+		{
+			bl = 1, br = 0;
+		}
+		if (ey != 0)
+		{
+			float t0 = c0 / ey, t1 = c1 / ey;
+			float ml = ax + (t0 < t1 ? t0 : t1), mr = ax + (t0 < t1 ? t1 : t0);
+			if (ml > bl) bl = ml;
+			if (mr < br) br = mr;
+		}
+		else if (c0 > 0 || c1 < 0)
 		{
-			err -= dy;
-			x1 += sx;
+			bl = 1, br = 0;
 		}
-		if (e2 < dy)
+		if (bl <= br)
 		{
-			err += dx;
-			y1 += sy;
+			if (bl < lo) lo = bl;
+			if (br > hi) hi = br;
 		}
-		fb_draw_round(x1, y1, r, color);
 	}
+	*l = lo;
+	*rr = hi;
+	return lo <= hi;
 }
 
-fb_image *fb_copy_image(const fb_image *src)
+#define AA_CHUNK 64 /*边缘像素一次算这么多个覆盖率*/
+
+struct fb_aa_cover
 {
-	fb_image *img = (fb_image *)malloc(sizeof(fb_image));
-	img->color_type = src->color_type;
-	img->line_byte = src->line_byte;
-	img->pixel_h = src->pixel_h;
-	img->pixel_w = src->pixel_w;
-	img->content = (char *)malloc(src->pixel_h * src->line_byte);
-	memcpy(img->content, src->content, src->pixel_h * src->line_byte);
-	return img;
-}
+	fb_image *target;
+	int stroke; /*最近开始的一笔, 1~255*/
+	uint16_t *cov; /*每个像素: 高8位是最后画它的笔号, 低8位是覆盖率(255表示完全覆盖)*/
+};
 
-fb_image* zoomin_image(const fb_image *img)
+/*按覆盖率混合一段像素: 先算完一段的覆盖率(没有分支, 编译器可以向量化), 再统一混合.
+  cv不为NULL时, 同一笔已经画过的像素只补到两次覆盖率中较大的那个*/
+static void _aa_blend_run(int32_t *dst, uint16_t *cv, int stroke, int x0, int n, float y, float ax, float ay, float ex, float ey, float inv_len2, float r, int color)
 {
-	if (img == NULL)
+	unsigned int a[AA_CHUNK];
+	unsigned int crb = color & 0xff00ff, cg = color & 0x00ff00;
+	while (n > 0)
 	{
-		return NULL;
+		int m = (n < AA_CHUNK) ? n : AA_CHUNK;
+		for (int i = 0; i < m; i++)
+		{
+			float px = x0 + i - ax, py = y - ay;
+			float t = (px * ex + py * ey) * inv_len2;
+			t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+			float dx = px - t * ex, dy = py - t * ey;
+			float c = r + 0.5f - sqrtf(dx * dx + dy * dy);
+			c = (c < 0) ? 0 : (c > 1) ? 1 : c;
+			a[i] = (unsigned int)(c * 256);
+		}
+		for (int i = 0; i < m; i++)
+		{
+			unsigned int f = a[i];
+			if (cv != NULL)
+			{
+				unsigned int p = ((cv[i] >> 8) == (unsigned int)stroke) ? (cv[i] & 0xff) : 0;
+				p = (p == 255) ? 256 : p;
+				if (f <= p)
+				{
+					continue;
+				}
+				cv[i] = (stroke << 8) | ((f > 255) ? 255 : f);
+				f = ((f - p) << 8) / (256 - p); /*已经按p混合过, 再混合这么多就等于按f混合*/
+			}
+			unsigned int d = dst[i];
+			unsigned int rb = ((crb * f + (d & 0xff00ff) * (256 - f)) >> 8) & 0xff00ff;
+			unsigned int g = ((cg * f + (d & 0x00ff00) * (256 - f)) >> 8) & 0x00ff00;
+			dst[i] = (f == 0) ? d : (d & 0xff000000) | rb | g;
+		}
+		dst += m;
+		cv = (cv != NULL) ? cv + m : NULL;
+		x0 += m;
+		n -= m;
 	}
-	int old_h = img->pixel_h, old_w = img->pixel_w, old_lb = img->line_byte, new_lb = old_lb * 2;
-	fb_image* new_img = fb_new_image(img->color_type, old_w * 2, old_h * 2, new_lb);
-	if (new_img == NULL)
+}
+
+/*画(x1,y1)-(x2,y2)扩张r得到的胶囊, 坐标是像素中心. 每行先算出胶囊的范围, 完全覆盖的部分
+  直接填, aa时两边按像素中心到线段的距离混合. 每个像素只写一次.
+  cover不为NULL时记下覆盖率, 同一笔stroke的相邻胶囊在连接处不会重复混合*/
+static void _draw_capsule(fb_ctx *ctx, int x1, int y1, int x2, int y2, float r, int color, int aa, fb_aa_cover *cover, int stroke)
+{
+	float ro = aa ? r + 0.5f : r; /*有像素被画到的范围*/
+	int bx = (int)floorf((x1 < x2 ? x1 : x2) - ro), by = (int)floorf((y1 < y2 ? y1 : y2) - ro);
+	int bw = (int)ceilf((x1 > x2 ? x1 : x2) + ro) + 1 - bx, bh = (int)ceilf((y1 > y2 ? y1 : y2) + ro) + 1 - by;
+	if(r <= 0 || !_ctx_clip(ctx, &bx, &by, &bw, &bh)) return;
+
+	float ax = x1 + ctx->ox, ay = y1 + ctx->oy;
+	float ex = x2 - x1, ey = y2 - y1;
+	float len = sqrtf(ex * ex + ey * ey);
+	float inv_len2 = (len > 0) ? 1 / (len * len) : 0;
+	int line_byte = ctx->target->line_byte;
+	if (!aa || (cover == NULL) || (cover->target != ctx->target) || (stroke <= 0) || (stroke > 255))
 	{
-		exit(-1);
+		cover = NULL;
 	}
-	int32_t *old = (int32_t*)img->content;
-	int32_t *new = (int32_t*)new_img->content;
-	int32_t *old_ptr, *new_ptr;
-	for (int row = 0; row < old_h; row++)
+	for (int y = by; y < by + bh; y++)
 	{
-		old_ptr = old + (row * old_w);
-		new_ptr = new + (2 * row * new_img->pixel_w);
-		for (int col = 0; col < old_w; col++)
+		float fl, fr, il, ir;
+		if (!_capsule_span(ax, ay, ex, ey, len, ro, y, &fl, &fr)) continue;
+		int l = (int)ceilf(fl), rr = (int)floorf(fr) + 1; /*[l, rr)*/
+		l = (l < bx) ? bx : l;
+		rr = (rr > bx + bw) ? bx + bw : rr;
+		if (l >= rr) continue;
+		int32_t *row = (int32_t *)(ctx->target->content + y * line_byte);
+		int sl = l, sr = l; /*实心部分[sl, sr)*/
+		if (!aa)
+		{
+			sr = rr;
+		}
+		else if ((r > 0.5f) && _capsule_span(ax, ay, ex, ey, len, r - 0.5f, y, &il, &ir))
+		{
+			sl = (int)ceilf(il);
+			sr = (int)floorf(ir) + 1;
+			sl = (sl < l) ? l : (sl > rr) ? rr : sl;
+			sr = (sr < sl) ? sl : (sr > rr) ? rr : sr;
+		}
+		uint16_t *cv = (cover != NULL) ? cover->cov + y * ctx->target->pixel_w : NULL;
+		if (sl > l) _aa_blend_run(row + l, cv ? cv + l : NULL, stroke, l, sl - l, y, ax, ay, ex, ey, inv_len2, r, color);
+		_fill_span(row + sl, sr - sl, color);
+		if (cv != NULL)
 		{
-			*(new_ptr++) = *old_ptr;
-			*(new_ptr++) = *(old_ptr++);
-		}	// 横向x2
-		memcpy(new_ptr, new_ptr - new_img->pixel_w, new_lb);	// 纵向x2
+			for (int x = sl; x < sr; x++)
+			{
+				cv[x] = (stroke << 8) | 255;
+			}
+		}
+		if (rr > sr) _aa_blend_run(row + sr, cv ? cv + sr : NULL, stroke, sr, rr - sr, y, ax, ay, ex, ey, inv_len2, r, color);
 	}
-	return new_img;
 }
 
-fb_image *zoomout_image(const fb_image *img)
+/*实心的胶囊, 每个像素只写一次*/
+void fb_ctx_draw_thick_line(fb_ctx *ctx, int x1, int y1, int x2, int y2, int r, int color)
 {
-	if (img == NULL)
+	if(r <= 0)
+	{
+		fb_ctx_draw_line(ctx, x1, y1, x2, y2, color);
+		return;
+	}
+	_draw_capsule(ctx, x1, y1, x2, y2, r, color, 0, NULL, 0);
+}
+
+void fb_ctx_draw_aa_line(fb_ctx *ctx, int x1, int y1, int x2, int y2, float r, int color)
+{
+	_draw_capsule(ctx, x1, y1, x2, y2, r, color, 1, NULL, 0);
+}
+
+void fb_ctx_draw_aa_round(fb_ctx *ctx, int x, int y, float r, int color)
+{
+	_draw_capsule(ctx, x, y, x, y, r, color, 1, NULL, 0);
+}
+
+void fb_draw_aa_line(int x1, int y1, int x2, int y2, float r, int color)
+{
+	_draw_capsule(&screen_ctx, x1, y1, x2, y2, r, color, 1, NULL, 0);
+}
+
+void fb_draw_aa_round(int x, int y, float r, int color)
+{
+	_draw_capsule(&screen_ctx, x, y, x, y, r, color, 1, NULL, 0);
+}
+
+fb_aa_cover *fb_aa_cover_new(fb_image *target)
+{
+	if ((target == NULL) || (fb_color_bytes(target->color_type) != 4))
 	{
 		return NULL;
 	}
-	int old_h = img->pixel_h, old_w = img->pixel_w, old_lb = img->line_byte, new_lb = old_lb / 2;
-	fb_image *new_img = fb_new_image(img->color_type, old_w / 2, old_h / 2, (old_w / 2) * 4);
-	if (new_img == NULL)
+	fb_aa_cover *c = (fb_aa_cover *)malloc(sizeof(fb_aa_cover));
+	if (c == NULL)
 	{
-		exit(-1);
+		return NULL;
 	}
-	int32_t *old = (int32_t *)img->content;
-	int32_t *new = (int32_t *)new_img->content;
-	int32_t *old_ptr, *new_ptr;
-	for (int row = 0; row < new_img->pixel_h; row++)
+	c->target = target;
+	c->stroke = 0;
+	c->cov = (uint16_t *)calloc((size_t)target->pixel_w * target->pixel_h, sizeof(uint16_t));
+	if (c->cov == NULL)
 	{
-		old_ptr = old + (2 * row * old_w);
-		new_ptr = new + (row * new_img->pixel_w);
-		for (int col = 0; col < new_img->pixel_w; col++)
-		{
-			*(new_ptr++) = *old_ptr;
-			old_ptr += 2;
-		}
+		free(c);
+		return NULL;
 	}
-	return new_img;
+	return c;
 }
 
-fb_image* zoom_image(const fb_image *img, int level)
+void fb_aa_cover_free(fb_aa_cover *c)
 {
-	if (img == NULL)
+	if (c == NULL)
 	{
-		return NULL;
+		return;
 	}
-	if (level == 0)
+	free(c->cov);
+	free(c);
+}
+
+int fb_aa_cover_begin(fb_aa_cover *c)
+{
+	if (c == NULL)
 	{
-		return fb_copy_image(img);
+		return 0;
 	}
-	fb_image *new_img = NULL;
-	fb_image *old_img = fb_copy_image(img);
-	if (level < 0)
+	if (++c->stroke > 255) /*笔号用完, 清掉旧的记录重新编号*/
 	{
-		for (int i = level; i < 0; i++)
-		{
-			new_img = zoomout_image(old_img);
-			fb_free_image(old_img);
-			old_img = new_img;
-		}
+		memset(c->cov, 0, (size_t)c->target->pixel_w * c->target->pixel_h * sizeof(uint16_t));
+		c->stroke = 1;
 	}
-	else
+	return c->stroke;
+}
+
+void fb_ctx_draw_aa_stroke(fb_ctx *ctx, fb_aa_cover *cover, int stroke, int x1, int y1, int x2, int y2, float r, int color)
+{
+	_draw_capsule(ctx, x1, y1, x2, y2, r, color, 1, cover, stroke);
+}
+
+void fb_draw_aa_stroke(fb_aa_cover *cover, int stroke, int x1, int y1, int x2, int y2, float r, int color)
+{
+	_draw_capsule(&screen_ctx, x1, y1, x2, y2, r, color, 1, cover, stroke);
+}
+
+void fb_draw_thick_line(int x1, int y1, int x2, int y2, int r, int color)
+{
+	fb_ctx_draw_thick_line(&screen_ctx, x1, y1, x2, y2, r, color);
+}
+
+fb_image *fb_copy_image(const fb_image *src)
+{
+	fb_image *img = fb_new_image(src->color_type, src->pixel_w, src->pixel_h, 0);
+	if (img == NULL)
 	{
-		for (int i = level; i > 0; i--)
-		{
-			new_img = zoomin_image(old_img);
-			fb_free_image(old_img);
-			old_img = new_img;
-		}
+		return NULL;
+	}
+	int row_bytes = src->pixel_w * fb_color_bytes(src->color_type);
+	for (int row = 0; row < src->pixel_h; row++)
+	{
+		memcpy(img->content + row * img->line_byte, src->content + row * src->line_byte, row_bytes);
+	}
+	if (src->color_type == FB_COLOR_PALETTE_8)
+	{
+		memcpy(img->palette, src->palette, FB_PALETTE_SIZE * 4);
+		img->palette_opaque = src->palette_opaque;
 	}
-	return new_img;
-}
\ No newline at end of file
+	return img;
+}
+
+/*============================ layers ============================*/
+/* 图层按z从小到大排在链表里. 图层的内容、位置、z或不透明度变化时只记下屏幕上的
+ * 损坏区域和从哪个z开始变了, 到fb_update时才把这些区域内从这个z往上的图层依次合成到
+ * DRAW_BUF, 下面没变的图层不动, 没有变化的帧不花任何时间. 半透明的图层保存着合成前
+ * 屏幕上的内容(under), 重新合成前先恢复它, 不会一遍遍叠在自己上一次的结果上; 下面的
+ * 图层重新合成时顺便更新它. 直接画到屏幕上的内容只会被它所在位置重新合成的图层盖掉.
+ * 图层移走、释放或改变z时下面的图层露出来, 这些区域从最底层开始重新合成. */
+
+#define LAYER_NAME_MAX	32
+#define DAMAGE_MAX	8	/*损坏区域超过这个数时合并成一个外接矩形*/
+#define DAMAGE_ALL	INT_MIN	/*露出了下面的图层, 从最底层开始重新合成*/
+
+struct fb_layer {
+	char name[LAYER_NAME_MAX];
+	fb_image *image;
+	int owned; /*image由fb_layer_new创建, 随图层一起释放*/
+	int x, y, z;
+	int opacity;
+	int *under; /*半透明时: 图层范围内合成前的屏幕内容, 按图层的宽度存放; NULL表示还没有保存*/
+	struct fb_layer *next;
+};
+
+static fb_layer *layer_list;
+static fb_rect damage_list[DAMAGE_MAX];
+static int damage_z[DAMAGE_MAX]; /*z不小于它的图层在这个区域内要重新合成*/
+static int damage_num = 0;
+
+static void _damage_add(int x, int y, int w, int h, int z)
+{
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (x + w > SCREEN_WIDTH) { w = SCREEN_WIDTH - x; }
+	if (y + h > SCREEN_HEIGHT) { h = SCREEN_HEIGHT - y; }
+	if ((w <= 0) || (h <= 0))
+	{
+		return;
+	}
+	if (damage_num == DAMAGE_MAX)
+	{
+		int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+		for (int i = 0; i < damage_num; i++)
+		{
+			fb_rect *d = &damage_list[i];
+			x1 = (d->x < x1) ? d->x : x1;
+			y1 = (d->y < y1) ? d->y : y1;
+			x2 = (d->x + d->w > x2) ? d->x + d->w : x2;
+			y2 = (d->y + d->h > y2) ? d->y + d->h : y2;
+			z = (damage_z[i] < z) ? damage_z[i] : z;
+		}
+		x = x1;
+		y = y1;
+		w = x2 - x1;
+		h = y2 - y1;
+		damage_num = 0;
+	}
+	damage_list[damage_num].x = x;
+	damage_list[damage_num].y = y;
+	damage_list[damage_num].w = w;
+	damage_list[damage_num].h = h;
+	damage_z[damage_num] = z;
+	damage_num++;
+}
+
+/*z是从哪一层开始重新合成: 只是图层自己变了时是它的z, 露出下面的图层时是DAMAGE_ALL*/
+static void _layer_damage(fb_layer *layer, const fb_rect *rect, int z)
+{
+	if (rect == NULL)
+	{
+		_damage_add(layer->x, layer->y, layer->image->pixel_w, layer->image->pixel_h, z);
+		return;
+	}
+	int x = rect->x, y = rect->y, w = rect->w, h = rect->h;
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (x + w > layer->image->pixel_w) { w = layer->image->pixel_w - x; }
+	if (y + h > layer->image->pixel_h) { h = layer->image->pixel_h - y; }
+	_damage_add(layer->x + x, layer->y + y, w, h, z);
+}
+
+static void _layer_insert(fb_layer *layer)
+{
+	fb_layer **pp = &layer_list;
+	while ((*pp != NULL) && ((*pp)->z <= layer->z))
+	{
+		pp = &(*pp)->next;
+	}
+	layer->next = *pp;
+	*pp = layer;
+}
+
+static void _layer_unlink(fb_layer *layer)
+{
+	fb_layer **pp = &layer_list;
+	while ((*pp != NULL) && (*pp != layer))
+	{
+		pp = &(*pp)->next;
+	}
+	if (*pp != NULL)
+	{
+		*pp = layer->next;
+	}
+}
+
+fb_layer *fb_layer_new_image(const char *name, fb_image *img, int z)
+{
+	if (img == NULL)
+	{
+		return NULL;
+	}
+	fb_layer *layer = (fb_layer *)calloc(1, sizeof(fb_layer));
+	if (layer == NULL)
+	{
+		return NULL;
+	}
+	strncpy(layer->name, name ? name : "", LAYER_NAME_MAX - 1);
+	layer->image = img;
+	layer->z = z;
+	layer->opacity = 255;
+	_layer_insert(layer);
+	fb_layer_damage(layer, NULL);
+	return layer;
+}
+
+fb_layer *fb_layer_new(const char *name, int w, int h, int z)
+{
+	fb_image *img = fb_new_image(FB_COLOR_RGB_8880, w, h, 0);
+	if (img == NULL)
+	{
+		return NULL;
+	}
+	for (int row = 0; row < h; row++)
+	{
+		memset(img->content + row * img->line_byte, 0, w * 4);
+	}
+	fb_layer *layer = fb_layer_new_image(name, img, z);
+	if (layer == NULL)
+	{
+		fb_free_image(img);
+		return NULL;
+	}
+	layer->owned = 1;
+	return layer;
+}
+
+fb_layer *fb_layer_find(const char *name)
+{
+	for (fb_layer *layer = layer_list; layer != NULL; layer = layer->next)
+	{
+		if (strcmp(layer->name, name) == 0)
+		{
+			return layer;
+		}
+	}
+	return NULL;
+}
+
+void fb_layer_free(fb_layer *layer)
+{
+	if (layer == NULL)
+	{
+		return;
+	}
+	_layer_damage(layer, NULL, DAMAGE_ALL);
+	_layer_unlink(layer);
+	if (layer->owned)
+	{
+		fb_free_image(layer->image);
+	}
+	free(layer->under);
+	free(layer);
+}
+
+fb_image *fb_layer_image(fb_layer *layer)
+{
+	return layer->image;
+}
+
+void fb_layer_damage(fb_layer *layer, const fb_rect *rect)
+{
+	_layer_damage(layer, rect, layer->z);
+}
+
+void fb_layer_move(fb_layer *layer, int x, int y)
+{
+	if ((layer->x == x) && (layer->y == y))
+	{
+		return;
+	}
+	_layer_damage(layer, NULL, DAMAGE_ALL); /*旧位置露出下面的图层*/
+	layer->x = x;
+	layer->y = y;
+	free(layer->under); /*新位置下面的内容到合成时再保存*/
+	layer->under = NULL;
+	fb_layer_damage(layer, NULL);
+}
+
+void fb_layer_set_z(fb_layer *layer, int z)
+{
+	if (layer->z == z)
+	{
+		return;
+	}
+	_layer_unlink(layer);
+	layer->z = z;
+	_layer_insert(layer);
+	_layer_damage(layer, NULL, DAMAGE_ALL); /*上下关系变了, 整块从底下重新合成*/
+}
+
+void fb_layer_set_opacity(fb_layer *layer, int opacity)
+{
+	opacity = (opacity < 0) ? 0 : (opacity > 255) ? 255 : opacity;
+	if (layer->opacity == opacity)
+	{
+		return;
+	}
+	layer->opacity = opacity;
+	_layer_damage(layer, NULL, (layer->under != NULL) ? layer->z : DAMAGE_ALL); /*原来不透明时下面的内容已经被盖掉了*/
+}
+
+void fb_layer_fill_rect(fb_layer *layer, int x, int y, int w, int h, int color)
+{
+	fb_ctx ctx;
+	fb_rect rect = {x, y, w, h};
+	fb_ctx_init(&ctx, layer->image); /*不是32位时裁剪区为空, 什么也不画*/
+	if (ctx.clip[0].w == 0)
+	{
+		return;
+	}
+	fb_ctx_draw_rect(&ctx, x, y, w, h, color);
+	fb_layer_damage(layer, &rect);
+}
+
+void fb_layer_draw_image(fb_layer *layer, int x, int y, fb_image *image, int color)
+{
+	fb_rect area;
+	if (fb_color_bytes(layer->image->color_type) != 4)
+	{
+		return;
+	}
+	if (_blit_image(layer->image, x, y, image, color, &area))
+	{
+		fb_layer_damage(layer, &area);
+	}
+}
+
+/*把图层在屏幕区域r内的部分合成到DRAW_BUF, r已经裁剪到图层范围内*/
+static void _layer_compose_rect(fb_layer *layer, const fb_rect *r)
+{
+	fb_image view = *layer->image;
+	fb_rect area;
+	view.content += (r->y - layer->y) * view.line_byte + (r->x - layer->x) * fb_color_bytes(view.color_type);
+	view.pixel_w = r->w;
+	view.pixel_h = r->h;
+	view.flags = FB_IMAGE_VIEW;
+	_begin_draw(r->x, r->y, r->w, r->h);
+	if ((layer->opacity == 255) || (fb_color_bytes(view.color_type) != 4)) /*其它格式不支持半透明*/
+	{
+		_blit_image(&SCREEN_IMAGE, r->x, r->y, &view, 0, &area);
+		return;
+	}
+	int has_alpha = (view.color_type == FB_COLOR_RGBA_8888);
+	for (int row = 0; row < r->h; row++)
+	{
+		unsigned int *s = (unsigned int *)(view.content + row * view.line_byte);
+		unsigned int *d = (unsigned int *)(DRAW_BUF + (r->y + row) * SCREEN_WIDTH + r->x);
+		for (int col = 0; col < r->w; col++)
+		{
+			unsigned int c = s[col], o = d[col];
+			unsigned int a = has_alpha ? ((c >> 24) * layer->opacity) >> 8 : (unsigned int)layer->opacity;
+			unsigned int rb = (((c & 0xff00ff) * a + (o & 0xff00ff) * (256 - a)) >> 8) & 0xff00ff;
+			unsigned int g = (((c & 0x00ff00) * a + (o & 0x00ff00) * (256 - a)) >> 8) & 0x00ff00;
+			d[col] = (o & 0xff000000) | rb | g;
+		}
+	}
+}
+
+/*图层和屏幕区域d的交集, 没有交集时返回0*/
+static int _layer_intersect(const fb_layer *layer, const fb_rect *d, fb_rect *r)
+{
+	int x1 = (d->x > layer->x) ? d->x : layer->x;
+	int y1 = (d->y > layer->y) ? d->y : layer->y;
+	int x2 = (d->x + d->w < layer->x + layer->image->pixel_w) ? d->x + d->w : layer->x + layer->image->pixel_w;
+	int y2 = (d->y + d->h < layer->y + layer->image->pixel_h) ? d->y + d->h : layer->y + layer->image->pixel_h;
+	if ((x2 <= x1) || (y2 <= y1))
+	{
+		return 0;
+	}
+	r->x = x1;
+	r->y = y1;
+	r->w = x2 - x1;
+	r->h = y2 - y1;
+	return 1;
+}
+
+/*合成时要和下面的内容混合的图层*/
+static int _layer_translucent(const fb_layer *layer)
+{
+	int type = layer->image->color_type;
+	return (layer->opacity < 255) || (type == FB_COLOR_RGBA_8888) || (type == FB_COLOR_ALPHA_8) ||
+		((type == FB_COLOR_PALETTE_8) && !layer->image->palette_opaque);
+}
+
+/*屏幕区域r(在图层范围内)的内容存进layer->under(save为1), 或者从它恢复(save为0)*/
+static void _layer_under_copy(fb_layer *layer, const fb_rect *r, int save)
+{
+	int w = layer->image->pixel_w;
+	for (int row = 0; row < r->h; row++)
+	{
+		int *u = layer->under + (r->y - layer->y + row) * w + (r->x - layer->x);
+		int *d = DRAW_BUF + (r->y + row) * SCREEN_WIDTH + r->x;
+		if (save)
+		{
+			memcpy(u, d, r->w * 4);
+		}
+		else
+		{
+			memcpy(d, u, r->w * 4);
+		}
+	}
+}
+
+/*半透明的图层合成前先恢复下面的内容; 第一次合成时图层还没画上去, 整个保存下来*/
+static void _layer_restore_under(fb_layer *layer, const fb_rect *r)
+{
+	fb_rect screen = {0, 0, SCREEN_WIDTH, SCREEN_HEIGHT}, all;
+	if (layer->under != NULL)
+	{
+		_layer_under_copy(layer, r, 0);
+		return;
+	}
+	layer->under = (int *)malloc((size_t)layer->image->pixel_w * layer->image->pixel_h * 4);
+	if ((layer->under != NULL) && _layer_intersect(layer, &screen, &all))
+	{
+		_layer_under_copy(layer, &all, 1);
+	}
+}
+
+static void _compose_layers(void)
+{
+	for (int i = 0; i < damage_num; i++)
+	{
+		fb_rect *d = &damage_list[i], r, q;
+		for (fb_layer *layer = layer_list; layer != NULL; layer = layer->next)
+		{
+			if ((layer->z < damage_z[i]) || (layer->opacity == 0) || !_layer_intersect(layer, d, &r))
+			{
+				continue; /*下面没变的图层不重新合成, 盖在它上面直接画的内容还留着*/
+			}
+			if (_layer_translucent(layer))
+			{
+				_layer_restore_under(layer, &r);
+			}
+			_layer_compose_rect(layer, &r);
+			for (fb_layer *up = layer->next; up != NULL; up = up->next)
+			{
+				if ((up->under != NULL) && _layer_intersect(up, &r, &q))
+				{
+					_layer_under_copy(up, &q, 1); /*上面的半透明图层以后恢复的是新合成的内容*/
+				}
+			}
+		}
+	}
+	damage_num = 0;
+}
+
+/*============================ touch-to-photon latency ============================*/
+
+#define OVERLAY_W 240
+#define OVERLAY_H 24
+
+static fb_latency_stat latency;
+static long long latency_pending = -1; /*最早未显示的输入时刻, -1表示没有*/
+static fb_layer *overlay_layer;
+static long long overlay_time; /*上次刷新叠加层的时刻*/
+static int overlay_count = -1; /*上次刷新时的样本数*/
+
+long long fb_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void fb_latency_input(long long time_us)
+{
+	if ((latency_pending < 0) || (time_us < latency_pending))
+	{
+		latency_pending = time_us;
+	}
+}
+
+static void _latency_present(int presented)
+{
+	if (latency_pending < 0)
+	{
+		return;
+	}
+	if (presented)
+	{
+		long long d = fb_time_us() - latency_pending;
+		if (d < 0) d = 0;
+		if (d > 0x7fffffff) d = 0x7fffffff;
+		int us = (int)d;
+		int ms = us / 1000;
+		latency.hist[(ms < FB_LATENCY_BUCKETS) ? ms : FB_LATENCY_BUCKETS - 1]++;
+		if ((latency.count == 0) || (us < latency.min_us)) latency.min_us = us;
+		if (us > latency.max_us) latency.max_us = us;
+		latency.last_us = us;
+		latency.sum_us += us;
+		latency.count++;
+	}
+	latency_pending = -1;
+}
+
+void fb_latency_get_stat(fb_latency_stat *stat)
+{
+	*stat = latency;
+}
+
+int fb_latency_percentile(const fb_latency_stat *stat, int percent)
+{
+	if (stat->count == 0)
+	{
+		return -1;
+	}
+	long long need = ((long long)stat->count * percent + 99) / 100;
+	if (need < 1) need = 1;
+	long long sum = 0;
+	for (int i = 0; i < FB_LATENCY_BUCKETS; i++)
+	{
+		sum += stat->hist[i];
+		if (sum >= need)
+		{
+			return i;
+		}
+	}
+	return FB_LATENCY_BUCKETS - 1;
+}
+
+void fb_latency_print(void)
+{
+	if (latency.count == 0)
+	{
+		printf("latency: no samples\n");
+		return;
+	}
+	printf("latency: %d frames, min %d.%03dms p50 %dms p95 %dms p99 %dms max %d.%03dms avg %lldus\n", latency.count,
+		latency.min_us / 1000, latency.min_us % 1000, fb_latency_percentile(&latency, 50),
+		fb_latency_percentile(&latency, 95), fb_latency_percentile(&latency, 99),
+		latency.max_us / 1000, latency.max_us % 1000, latency.sum_us / latency.count);
+}
+
+void fb_latency_reset(void)
+{
+	memset(&latency, 0, sizeof(latency));
+	latency_pending = -1;
+	overlay_count = -1;
+}
+
+void fb_latency_overlay(int on)
+{
+	if (on && (overlay_layer == NULL))
+	{
+		overlay_layer = fb_layer_new("latency", OVERLAY_W, OVERLAY_H, 0x7fffffff);
+		if (overlay_layer != NULL)
+		{
+			/*不用fb_layer_move: 它会把(0,0)处当成露出来的区域从底下重新合成, 盖掉应用直接画的内容.
+			  (0,0)处的损坏只合成z不小于叠加层的图层, 叠加层已经不在那里, 什么也不画*/
+			overlay_layer->x = SCREEN_WIDTH - OVERLAY_W;
+			overlay_layer->y = SCREEN_HEIGHT - OVERLAY_H;
+			fb_layer_damage(overlay_layer, NULL);
+		}
+		overlay_count = -1;
+	}
+	else if (!on && (overlay_layer != NULL))
+	{
+		fb_layer_free(overlay_layer); /*露出的地方由应用自己重画*/
+		overlay_layer = NULL;
+	}
+}
+
+/*有新样本时最多每FB_LATENCY_OVERLAY_MS重画一次. fb_update在它之前记下应用有没有画东西,
+  叠加层自己的刷新不产生样本; 它在最上层, 刷新时只重新合成它自己, 下面的图层和直接画的内容不动*/
+static void _latency_overlay_update(void)
+{
+	if ((overlay_layer == NULL) || (overlay_count == latency.count))
+	{
+		return;
+	}
+	long long now = fb_time_us();
+	if ((overlay_count >= 0) && (now - overlay_time < FB_LATENCY_OVERLAY_MS * 1000))
+	{
+		return;
+	}
+	char text[64];
+	if (latency.count == 0)
+	{
+		snprintf(text, sizeof(text), "latency: -");
+	}
+	else
+	{
+		snprintf(text, sizeof(text), "%d.%dms p50 %d p95 %d", latency.last_us / 1000, latency.last_us / 100 % 10,
+			fb_latency_percentile(&latency, 50), fb_latency_percentile(&latency, 95));
+	}
+	fb_ctx ctx;
+	fb_ctx_init(&ctx, fb_layer_image(overlay_layer));
+	fb_ctx_draw_rect(&ctx, 0, 0, OVERLAY_W, OVERLAY_H, FB_COLOR(0x20, 0x20, 0x20));
+	fb_ctx_draw_text(&ctx, 6, OVERLAY_H - 6, text, 16, FB_COLOR(0xff, 0xff, 0x00));
+	fb_layer_damage(overlay_layer, NULL);
+	overlay_time = now;
+	overlay_count = latency.count;
+}
+
+/*============================ image scaling ============================*/
+/* 任意比例单趟缩放. 32位像素拆成 0x00RR00BB 和 0x00AA00GG 两组, 每组一次乘法
+ * 同时算两个通道(寄存器内SIMD), ARM32和x86上都不依赖特定指令集.
+ * 紧凑格式的源图片在用到时才逐行展开成32位, 只展开要读的列.
+ * 输出较大时按行分带, 通过task_parallel在多核上并行. */
+
+#define SCALE_BAND_ROWS		32	/*每个并行任务处理的输出行数*/
+#define SCALE_PARALLEL_MIN	(128*1024)	/*输出像素少于此数时不开线程*/
+
+typedef struct
+{
+	const fb_image *src;
+	fb_image *dst; /*输出的是整幅dw*dh缩放结果中从(ox,oy)开始的一块*/
+	int dw, dh;
+	int ox, oy;
+	int filter;
+	int *xofs;	 /*每个输出列对应的源列(双线性时为左侧源列)*/
+	unsigned char *xw; /*双线性: 右侧源列的权重, 0~255*/
+	int sx0, sx1; /*要读的源列范围*/
+	int slots;	  /*一个输出行同时用到的源行数上限*/
+} scale_job;
+
+/*每个分带自己的源行缓存, 源行号sy放在第sy%slots个槽里*/
+typedef struct
+{
+	const scale_job *job;
+	int *tag; /*槽里是哪一行, -1表示空*/
+	unsigned int *buf; /*源图片已经是32位时为NULL, 直接读源图片*/
+	const unsigned int **ptr; /*面积平均: 当前输出行覆盖的各源行*/
+} scale_rows;
+
+/*紧凑格式展开后的32位格式*/
+static int _expanded_type(int color_type)
+{
+	if (fb_color_bytes(color_type) == 4)
+	{
+		return color_type;
+	}
+	return (color_type == FB_COLOR_PALETTE_8) ? FB_COLOR_RGBA_8888 : FB_COLOR_RGB_8880;
+}
+
+/*取源图片第sy行, 下标是源列号*/
+static const unsigned int *_src_row(scale_rows *rows, int sy)
+{
+	const fb_image *src = rows->job->src;
+	const unsigned char *s = (const unsigned char *)src->content + sy * src->line_byte;
+	if (rows->buf == NULL)
+	{
+		return (const unsigned int *)s;
+	}
+	int slot = sy % rows->job->slots;
+	unsigned int *d = rows->buf + slot * src->pixel_w;
+	if (rows->tag[slot] == sy)
+	{
+		return d;
+	}
+	rows->tag[slot] = sy;
+	int x0 = rows->job->sx0, x1 = rows->job->sx1;
+	switch (src->color_type)
+	{
+	case FB_COLOR_RGB_565:
+		for (int x = x0; x < x1; x++)
+		{
+			d[x] = FB_RGB565_TO_COLOR(((const unsigned short *)s)[x]);
+		}
+		break;
+	case FB_COLOR_GRAY_8:
+		for (int x = x0; x < x1; x++)
+		{
+			d[x] = 0xff000000 | (s[x] * 0x010101);
+		}
+		break;
+	case FB_COLOR_PALETTE_8:
+		for (int x = x0; x < x1; x++)
+		{
+			d[x] = src->palette[s[x]];
+		}
+		break;
+	}
+	return d;
+}
+
+/* p*(256-f) + q*f, f取0~255, 每个16位通道最大255*256, 不会溢出到相邻通道 */
+static inline unsigned int _lerp_pixel(unsigned int p, unsigned int q, unsigned int f)
+{
+	unsigned int rb = (((p & 0xff00ff) * (256 - f) + (q & 0xff00ff) * f) >> 8) & 0xff00ff;
+	unsigned int ag = (((p >> 8) & 0xff00ff) * (256 - f) + ((q >> 8) & 0xff00ff) * f) & 0xff00ff00;
+	return rb | ag;
+}
+
+static void _scale_rows_nearest(scale_job *job, scale_rows *rows, int y0, int y1)
+{
+	const fb_image *src = job->src;
+	fb_image *dst = job->dst;
+	int w = dst->pixel_w;
+	const int *xofs = job->xofs;
+	for (int y = y0; y < y1; y++)
+	{
+		int sy = (int)((long long)(y + job->oy) * src->pixel_h / job->dh);
+		const unsigned int *s = _src_row(rows, sy);
+		unsigned int *d = (unsigned int *)(dst->content + y * dst->line_byte);
+		for (int x = 0; x < w; x++)
+		{
+			d[x] = s[xofs[x]];
+		}
+	}
+}
+
+static void _scale_rows_bilinear(scale_job *job, scale_rows *rows, int y0, int y1)
+{
+	const fb_image *src = job->src;
+	fb_image *dst = job->dst;
+	int w = dst->pixel_w;
+	const int *xofs = job->xofs;
+	const unsigned char *xw = job->xw;
+	long long step = ((long long)src->pixel_h << 16) / job->dh;
+	for (int y = y0; y < y1; y++)
+	{
+		/*像素中心对齐: sy = (y+0.5)*sh/dh - 0.5*/
+		long long pos = (y + job->oy) * step + step / 2 - 0x8000;
+		if (pos < 0)
+		{
+			pos = 0;
+		}
+		int sy = (int)(pos >> 16);
+		unsigned int fy = (pos >> 8) & 0xff;
+		int sy1 = (sy + 1 < src->pixel_h) ? sy + 1 : sy;
+		const unsigned int *r0 = _src_row(rows, sy);
+		const unsigned int *r1 = _src_row(rows, sy1);
+		unsigned int *d = (unsigned int *)(dst->content + y * dst->line_byte);
+		int last = src->pixel_w - 1;
+		for (int x = 0; x < w; x++)
+		{
+			int sx = xofs[x];
+			int sx1 = (sx < last) ? sx + 1 : sx;
+			unsigned int top = _lerp_pixel(r0[sx], r0[sx1], xw[x]);
+			unsigned int bot = _lerp_pixel(r1[sx], r1[sx1], xw[x]);
+			d[x] = _lerp_pixel(top, bot, fy);
+		}
+	}
+}
+
+/*面积平均: 每个输出像素取其覆盖的源像素块的平均值, 每个源像素只读一次*/
+static void _scale_rows_box(scale_job *job, scale_rows *rows, int y0, int y1)
+{
+	const fb_image *src = job->src;
+	fb_image *dst = job->dst;
+	int w = dst->pixel_w;
+	const int *xofs = job->xofs; /*xofs[x]~xofs[x+1]是第x列覆盖的源列*/
+	for (int y = y0; y < y1; y++)
+	{
+		int sy0 = (int)((long long)(y + job->oy) * src->pixel_h / job->dh);
+		int sy1 = (int)((long long)(y + job->oy + 1) * src->pixel_h / job->dh);
+		if (sy1 <= sy0)
+		{
+			sy1 = sy0 + 1;
+		}
+		for (int sy = sy0; sy < sy1; sy++)
+		{
+			rows->ptr[sy - sy0] = _src_row(rows, sy);
+		}
+		unsigned int *d = (unsigned int *)(dst->content + y * dst->line_byte);
+		for (int x = 0; x < w; x++)
+		{
+			int sx0 = xofs[x], sx1 = xofs[x + 1];
+			if (sx1 <= sx0)
+			{
+				sx1 = sx0 + 1;
+			}
+			unsigned int rb = 0, ag = 0, rb_hi = 0, ag_hi = 0;
+			for (int sy = sy0; sy < sy1; sy++)
+			{
+				const unsigned int *s = rows->ptr[sy - sy0];
+				/*16位通道最多累加256个像素, 之后拆到32位计数里, 防止溢出到相邻通道*/
+				for (int sx = sx0; sx < sx1;)
+				{
+					int end = (sx1 - sx > 256) ? sx + 256 : sx1;
+					unsigned int part_rb = 0, part_ag = 0;
+					for (; sx < end; sx++)
+					{
+						part_rb += s[sx] & 0xff00ff;
+						part_ag += (s[sx] >> 8) & 0xff00ff;
+					}
+					rb += part_rb & 0xffff;
+					rb_hi += part_rb >> 16;
+					ag += part_ag & 0xffff;
+					ag_hi += part_ag >> 16;
+				}
+			}
+			unsigned int n = (sx1 - sx0) * (sy1 - sy0);
+			d[x] = ((rb + n / 2) / n) | (((rb_hi + n / 2) / n) << 16) |
+				   (((ag + n / 2) / n) << 8) | (((ag_hi + n / 2) / n) << 24);
+		}
+	}
+}
+
+static void _scale_band(int band, void *arg)
+{
+	scale_job *job = (scale_job *)arg;
+	int y0 = band * SCALE_BAND_ROWS;
+	int y1 = y0 + SCALE_BAND_ROWS;
+	if (y1 > job->dst->pixel_h)
+	{
+		y1 = job->dst->pixel_h;
+	}
+	scale_rows rows = {job, NULL, NULL, NULL};
+	int compact = (fb_color_bytes(job->src->color_type) != 4);
+	rows.ptr = (const unsigned int **)malloc(job->slots * sizeof(*rows.ptr));
+	if (compact)
+	{
+		rows.tag = (int *)malloc(job->slots * sizeof(int));
+		rows.buf = (unsigned int *)malloc((size_t)job->slots * job->src->pixel_w * 4);
+	}
+	if ((rows.ptr == NULL) || (compact && ((rows.tag == NULL) || (rows.buf == NULL))))
+	{
+		free(rows.ptr);
+		free(rows.tag);
+		free(rows.buf);
+		return;
+	}
+	if (compact)
+	{
+		memset(rows.tag, -1, job->slots * sizeof(int));
+	}
+	if (job->filter == FB_FILTER_BILINEAR)
+	{
+		_scale_rows_bilinear(job, &rows, y0, y1);
+	}
+	else if (job->filter == FB_FILTER_BOX)
+	{
+		_scale_rows_box(job, &rows, y0, y1);
+	}
+	else
+	{
+		_scale_rows_nearest(job, &rows, y0, y1);
+	}
+	free(rows.ptr);
+	free(rows.tag);
+	free(rows.buf);
+}
+
+/*把src缩放到dw*dh后, 从(ox,oy)开始取dst大小的一块写入dst.
+  dst是src展开后的32位格式(_expanded_type), src不能是FB_COLOR_ALPHA_8*/
+static int _scale_into(const fb_image *src, fb_image *dst, int dw, int dh, int ox, int oy, int filter)
+{
+	int w = dst->pixel_w, h = dst->pixel_h;
+	if ((w <= 0) || (h <= 0) || (src->pixel_w <= 0) || (src->pixel_h <= 0))
+	{
+		return 0;
+	}
+
+	/*预先算好每一列的源坐标, 所有行共用*/
+	scale_job job;
+	job.src = src;
+	job.dst = dst;
+	job.dw = dw;
+	job.dh = dh;
+	job.ox = ox;
+	job.oy = oy;
+	job.filter = filter;
+	job.xofs = (int *)malloc((w + 1) * sizeof(int));
+	job.xw = (unsigned char *)malloc(w + 1);
+	if ((job.xofs == NULL) || (job.xw == NULL))
+	{
+		free(job.xofs);
+		free(job.xw);
+		return -1;
+	}
+	long long step = ((long long)src->pixel_w << 16) / dw;
+	for (int x = 0; x <= w; x++)
+	{
+		int gx = x + ox; /*在整幅输出中的列*/
+		if (filter == FB_FILTER_BILINEAR)
+		{
+			long long pos = gx * step + step / 2 - 0x8000;
+			if (pos < 0)
+			{
+				pos = 0;
+			}
+			job.xofs[x] = (int)(pos >> 16);
+			if (job.xofs[x] > src->pixel_w - 1)
+			{
+				job.xofs[x] = src->pixel_w - 1;
+			}
+			job.xw[x] = (pos >> 8) & 0xff;
+		}
+		else
+		{
+			job.xofs[x] = (int)((long long)gx * src->pixel_w / dw);
+			if ((x < w) && (job.xofs[x] > src->pixel_w - 1))
+			{
+				job.xofs[x] = src->pixel_w - 1;
+			}
+		}
+	}
+
+	job.sx0 = job.xofs[0];
+	job.sx1 = job.xofs[w] + 2; /*双线性多读右边一列, 面积平均读到xofs[w]*/
+	if (job.sx1 > src->pixel_w)
+	{
+		job.sx1 = src->pixel_w;
+	}
+	job.slots = (filter == FB_FILTER_BOX) ? src->pixel_h / dh + 2 : 2;
+
+	int bands = (h + SCALE_BAND_ROWS - 1) / SCALE_BAND_ROWS;
+	if ((long long)w * h >= SCALE_PARALLEL_MIN)
+	{
+		task_parallel(bands, _scale_band, NULL, &job);
+	}
+	else
+	{
+		for (int i = 0; i < bands; i++)
+		{
+			_scale_band(i, &job);
+		}
+	}
+
+	free(job.xofs);
+	free(job.xw);
+	return 0;
+}
+
+fb_image *fb_scale_image(const fb_image *img, int w, int h, int filter)
+{
+	if ((img == NULL) || (w < 0) || (h < 0))
+	{
+		return NULL;
+	}
+	if ((w == img->pixel_w) && (h == img->pixel_h))
+	{
+		return fb_copy_image(img);
+	}
+	if ((fb_color_bytes(img->color_type) == 0) || (img->color_type == FB_COLOR_ALPHA_8))
+	{
+		return NULL;
+	}
+	fb_image *dst = fb_new_image(_expanded_type(img->color_type), w, h, 0);
+	if ((dst != NULL) && (_scale_into(img, dst, w, h, 0, 0, filter) < 0))
+	{
+		fb_free_image(dst);
+		dst = NULL;
+	}
+	return dst;
+}
+
+/*缩放后直接画到32位的target上, 只计算clip内可见的像素, 不生成整幅缩放图片*/
+static void _draw_scaled(fb_image *target, int x, int y, fb_image *img, const fb_rect *src_rect, int scale, const fb_rect *clip)
+{
+	if ((img == NULL) || (scale <= 0) || (fb_color_bytes(img->color_type) == 0) || (img->color_type == FB_COLOR_ALPHA_8))
+	{
+		return;
+	}
+	fb_rect sr = {0, 0, img->pixel_w, img->pixel_h};
+	if (src_rect != NULL)
+	{
+		sr = *src_rect;
+		if (sr.x < 0) { sr.w += sr.x; sr.x = 0; }
+		if (sr.y < 0) { sr.h += sr.y; sr.y = 0; }
+		if (sr.x + sr.w > img->pixel_w) { sr.w = img->pixel_w - sr.x; }
+		if (sr.y + sr.h > img->pixel_h) { sr.h = img->pixel_h - sr.y; }
+	}
+	int dw = (int)(((long long)sr.w * scale) >> 16);
+	int dh = (int)(((long long)sr.h * scale) >> 16);
+	if ((sr.w <= 0) || (sr.h <= 0) || (dw <= 0) || (dh <= 0))
+	{
+		return;
+	}
+
+	/*可见区域 = 缩放后的矩形 ∩ clip ∩ target*/
+	fb_rect r = {0, 0, target->pixel_w, target->pixel_h};
+	if (clip != NULL)
+	{
+		r = *clip;
+	}
+	long long x1 = (r.x > x) ? r.x : x;
+	long long y1 = (r.y > y) ? r.y : y;
+	long long x2 = ((long long)r.x + r.w < (long long)x + dw) ? (long long)r.x + r.w : (long long)x + dw;
+	long long y2 = ((long long)r.y + r.h < (long long)y + dh) ? (long long)r.y + r.h : (long long)y + dh;
+	if (x1 < 0) x1 = 0;
+	if (y1 < 0) y1 = 0;
+	if (x2 > target->pixel_w) x2 = target->pixel_w;
+	if (y2 > target->pixel_h) y2 = target->pixel_h;
+	if ((x1 >= x2) || (y1 >= y2))
+	{
+		return;
+	}
+	int vw = (int)(x2 - x1), vh = (int)(y2 - y1);
+
+	fb_image sv = *img; /*源矩形的视图*/
+	sv.content += sr.y * img->line_byte + sr.x * fb_color_bytes(img->color_type);
+	sv.pixel_w = sr.w;
+	sv.pixel_h = sr.h;
+	int type = _expanded_type(sv.color_type);
+	int filter = (scale >= FB_SCALE_ONE) ? FB_FILTER_BILINEAR : FB_FILTER_BOX;
+
+	if (type == FB_COLOR_RGB_8880) /*不透明: 直接缩放进目标图片*/
+	{
+		fb_image dv;
+		dv.color_type = FB_COLOR_RGB_8880;
+		dv.pixel_w = vw;
+		dv.pixel_h = vh;
+		dv.line_byte = target->line_byte;
+		dv.content = target->content + y1 * target->line_byte + x1 * 4;
+		dv.flags = FB_IMAGE_VIEW;
+		dv.palette = NULL;
+		dv.palette_opaque = 0;
+		_scale_into(&sv, &dv, dw, dh, (int)(x1 - x), (int)(y1 - y), filter);
+	}
+	else /*带alpha: 只缩放可见部分, 再混合*/
+	{
+		fb_image *part = fb_new_image(type, vw, vh, 0);
+		if (part != NULL)
+		{
+			_scale_into(&sv, part, dw, dh, (int)(x1 - x), (int)(y1 - y), filter);
+			fb_rect area;
+			_blit_image(target, (int)x1, (int)y1, part, 0, &area);
+			fb_free_image(part);
+		}
+	}
+	if (target == &SCREEN_IMAGE)
+	{
+		_begin_draw((int)x1, (int)y1, vw, vh);
+	}
+}
+
+void fb_draw_image_scaled(int x, int y, fb_image *img, const fb_rect *src_rect, int scale, const fb_rect *clip)
+{
+	if ((clip != NULL) && (fb_ctx_push_clip(&screen_ctx, clip->x, clip->y, clip->w, clip->h) < 0)) return;
+	fb_ctx_draw_image_scaled(&screen_ctx, x, y, img, src_rect, scale);
+	if (clip != NULL) fb_ctx_pop_clip(&screen_ctx);
+}
+
+/*clip取当前裁剪区*/
+void fb_ctx_draw_image_scaled(fb_ctx *ctx, int x, int y, fb_image *img, const fb_rect *src_rect, int scale)
+{
+	_draw_scaled(ctx->target, x + ctx->ox, y + ctx->oy, img, src_rect, scale, &ctx->clip[ctx->depth - 1]);
+}
+
+/*把rect内已画好的内容平移(dx,dy), 返回新露出的区域个数(最多2个), 写入exposed*/
+int fb_scroll_area(const fb_rect *rect, int dx, int dy, fb_rect exposed[2])
+{
+	int x = rect->x, y = rect->y, w = rect->w, h = rect->h;
+	if (!_ctx_intersect(&screen_ctx, &x, &y, &w, &h)) /*和其它fb_draw_*一样受屏幕上下文的原点和裁剪区影响*/
+	{
+		return 0;
+	}
+	if ((dx == 0) && (dy == 0))
+	{
+		return 0;
+	}
+	int ox = screen_ctx.ox, oy = screen_ctx.oy; /*露出的区域换回相对原点的坐标*/
+	if ((abs(dx) >= w) || (abs(dy) >= h)) /*全部移出, 整块重画*/
+	{
+		exposed[0].x = x - ox;
+		exposed[0].y = y - oy;
+		exposed[0].w = w;
+		exposed[0].h = h;
+		return 1;
+	}
+
+	int *buf = _begin_draw(x, y, w, h);
+	int cw = w - abs(dx), ch = h - abs(dy); /*保留下来的部分*/
+	int sx = (dx > 0) ? x : x - dx;
+	int sy = (dy > 0) ? y : y - dy;
+	/*向下移时从最后一行往上拷, 保证源行在被覆盖前已经拷走; 行内重叠交给memmove*/
+	int step = (dy > 0) ? -SCREEN_WIDTH : SCREEN_WIDTH;
+	int row = (dy > 0) ? ch - 1 : 0;
+	int *src = buf + (sy + row) * SCREEN_WIDTH + sx;
+	int *dst = src + dy * SCREEN_WIDTH + dx;
+	for (int i = 0; i < ch; i++)
+	{
+		memmove(dst, src, cw * 4);
+		src += step;
+		dst += step;
+	}
+
+	int n = 0;
+	if (dy != 0) /*上方或下方露出的整行*/
+	{
+		exposed[n].x = x - ox;
+		exposed[n].y = ((dy > 0) ? y : y + h + dy) - oy;
+		exposed[n].w = w;
+		exposed[n].h = abs(dy);
+		n++;
+	}
+	if (dx != 0) /*左边或右边露出的列, 不含上面已经算过的行*/
+	{
+		exposed[n].x = ((dx > 0) ? x : x + w + dx) - ox;
+		exposed[n].y = ((dy > 0) ? y + dy : y) - oy;
+		exposed[n].w = abs(dx);
+		exposed[n].h = ch;
+		n++;
+	}
+	return n;
+}
+
+/*============================ image rotation ============================*/
+/* 目标图片按ROTATE_BLOCK行分带, 带内再按ROTATE_BLOCK列分块, 一块内源图片只涉及
+ * 16行(或16列)的数据, 旋转90度时不会每个像素都跨一行读源图片而把缓存冲掉.
+ * 8种方向统一成: 目标向右一个像素源地址加x_step字节, 向下一个像素加y_step字节. */
+
+#define ROTATE_BLOCK	16
+
+typedef struct {
+	fb_image *dst;
+	const char *origin; /*目标(0,0)对应的源像素地址*/
+	long x_step, y_step;
+	int bpp;
+} rotate_job;
+
+static void _rotate_band(int band, void *arg)
+{
+	rotate_job *job = (rotate_job *)arg;
+	int w = job->dst->pixel_w;
+	int y0 = band * ROTATE_BLOCK;
+	int y1 = (y0 + ROTATE_BLOCK < job->dst->pixel_h) ? y0 + ROTATE_BLOCK : job->dst->pixel_h;
+	long xs = job->x_step;
+	for (int bx = 0; bx < w; bx += ROTATE_BLOCK)
+	{
+		int bw = (w - bx < ROTATE_BLOCK) ? w - bx : ROTATE_BLOCK;
+		for (int y = y0; y < y1; y++)
+		{
+			const char *s = job->origin + y * job->y_step + bx * xs;
+			char *d = job->dst->content + y * job->dst->line_byte + bx * job->bpp;
+			int x;
+			switch (job->bpp)
+			{
+			case 4:
+				for (x = 0; x < bw; x++, s += xs)
+				{
+					((int *)d)[x] = *(const int *)s;
+				}
+				break;
+			case 2:
+				for (x = 0; x < bw; x++, s += xs)
+				{
+					((short *)d)[x] = *(const short *)s;
+				}
+				break;
+			default:
+				for (x = 0; x < bw; x++, s += xs)
+				{
+					d[x] = *s;
+				}
+				break;
+			}
+		}
+	}
+}
+
+fb_image *fb_rotate_image(const fb_image *img, int orient)
+{
+	/*(x,y)为目标坐标, 源坐标 sx = c[0]*(W-1) + c[1]*x + c[2]*y, sy = c[3]*(H-1) + c[4]*x + c[5]*y*/
+	static const signed char map[8][6] = {
+		{0, 1, 0, 0, 0, 1},  /*FB_ORIENT_NORMAL*/
+		{1, -1, 0, 0, 0, 1}, /*FB_ORIENT_FLIP_H*/
+		{1, -1, 0, 1, 0, -1}, /*FB_ORIENT_ROT_180*/
+		{0, 1, 0, 1, 0, -1}, /*FB_ORIENT_FLIP_V*/
+		{0, 0, 1, 0, 1, 0},  /*FB_ORIENT_TRANSPOSE*/
+		{0, 0, 1, 1, -1, 0}, /*FB_ORIENT_ROT_90*/
+		{1, 0, -1, 1, -1, 0}, /*FB_ORIENT_TRANSVERSE*/
+		{1, 0, -1, 0, 1, 0}, /*FB_ORIENT_ROT_270*/
+	};
+	if ((img == NULL) || (orient < FB_ORIENT_NORMAL) || (orient > FB_ORIENT_ROT_270))
+	{
+		return NULL;
+	}
+	const signed char *c = map[orient - 1];
+	int bpp = fb_color_bytes(img->color_type);
+	int w = img->pixel_w, h = img->pixel_h;
+	if (orient >= FB_ORIENT_TRANSPOSE) /*宽高互换*/
+	{
+		w = img->pixel_h;
+		h = img->pixel_w;
+	}
+	fb_image *dst = fb_new_image(img->color_type, w, h, 0);
+	if (dst == NULL)
+	{
+		return NULL;
+	}
+	if (img->color_type == FB_COLOR_PALETTE_8)
+	{
+		memcpy(dst->palette, img->palette, FB_PALETTE_SIZE * 4);
+		dst->palette_opaque = img->palette_opaque;
+	}
+
+	rotate_job job;
+	int sx0 = c[0] * (img->pixel_w - 1), sy0 = c[3] * (img->pixel_h - 1);
+	job.dst = dst;
+	job.bpp = bpp;
+	job.origin = img->content + (long)sy0 * img->line_byte + (long)sx0 * bpp;
+	job.x_step = (long)c[1] * bpp + (long)c[4] * img->line_byte;
+	job.y_step = (long)c[2] * bpp + (long)c[5] * img->line_byte;
+
+	int bands = (h + ROTATE_BLOCK - 1) / ROTATE_BLOCK;
+	if ((long long)w * h >= SCALE_PARALLEL_MIN)
+	{
+		task_parallel(bands, _rotate_band, NULL, &job);
+	}
+	else
+	{
+		for (int i = 0; i < bands; i++)
+		{
+			_rotate_band(i, &job);
+		}
+	}
+	return dst;
+}
+
+/*============================ image pyramid ============================*/
+/* 第0层是原图, 第n层是第n-1层用面积平均缩小一半得到的, 第一次用到时才生成.
+ * 缩小到某个尺寸时从不小于目标的最小一层出发, 读的像素远少于从原图缩放. */
+
+#define PYRAMID_LEVEL_MAX	16
+
+struct fb_pyramid
+{
+	int levels; /*已生成的层数*/
+	fb_image *level[PYRAMID_LEVEL_MAX];
+};
+
+fb_pyramid *fb_pyramid_new(fb_image *img)
+{
+	if (img == NULL)
+	{
+		return NULL;
+	}
+	fb_pyramid *p = (fb_pyramid *)calloc(1, sizeof(fb_pyramid));
+	if (p == NULL)
+	{
+		return NULL;
+	}
+	p->level[0] = img;
+	p->levels = 1;
+	return p;
+}
+
+void fb_pyramid_free(fb_pyramid *p)
+{
+	if (p == NULL)
+	{
+		return;
+	}
+	for (int i = 1; i < p->levels; i++) // 第0层属于调用者
+	{
+		fb_free_image(p->level[i]);
+	}
+	free(p);
+}
+
+fb_image *fb_pyramid_level(fb_pyramid *p, int n)
+{
+	if ((p == NULL) || (n < 0) || (n >= PYRAMID_LEVEL_MAX))
+	{
+		return NULL;
+	}
+	while (p->levels <= n)
+	{
+		fb_image *prev = p->level[p->levels - 1];
+		if ((prev->pixel_w < 2) || (prev->pixel_h < 2))
+		{
+			return NULL; /*已经缩到最小*/
+		}
+		fb_image *next = fb_scale_image(prev, prev->pixel_w / 2, prev->pixel_h / 2, FB_FILTER_BOX);
+		if (next == NULL)
+		{
+			return NULL;
+		}
+		p->level[p->levels++] = next;
+	}
+	return p->level[n];
+}
+
+/*不小于目标尺寸的最小一层. 第n层的尺寸就是原图尺寸>>n, 先按尺寸选好层,
+  不会为了比较而多生成一层*/
+static fb_image *_pyramid_base(fb_pyramid *p, int w, int h)
+{
+	fb_image *img0 = p->level[0];
+	int n = 0;
+	while ((n + 1 < PYRAMID_LEVEL_MAX) && ((img0->pixel_w >> (n + 1)) >= w) && ((img0->pixel_h >> (n + 1)) >= h))
+	{
+		n++;
+	}
+	for (; n > 0; n--) /*生成失败时退回上一层*/
+	{
+		fb_image *img = fb_pyramid_level(p, n);
+		if (img != NULL)
+		{
+			return img;
+		}
+	}
+	return img0;
+}
+
+fb_image *fb_pyramid_scale(fb_pyramid *p, int w, int h)
+{
+	if ((p == NULL) || (w <= 0) || (h <= 0))
+	{
+		return NULL;
+	}
+	fb_image *base = _pyramid_base(p, w, h);
+	if ((base->pixel_w == w) && (base->pixel_h == h))
+	{
+		return fb_get_sub_image(base, 0, 0, w, h); /*正好是某一层, 不用拷贝*/
+	}
+	int filter = ((w > base->pixel_w) || (h > base->pixel_h)) ? FB_FILTER_BILINEAR : FB_FILTER_BOX;
+	return fb_scale_image(base, w, h, filter);
+}
+
+/*============================ canvas undo history ============================*/
+/* 画布就是一张32位的目标图片(例如屏幕), 历史按FB_CANVAS_TILE分块保存. 每一步只记下这一步
+ * 第一次改动的块改之前的样子, 撤销时再把当时的样子存下来供重做. 块的内容引用计数, 同样的
+ * 内容在画布最初的样子, 撤销和重做之间共享, 不重复拷贝. */
+
+typedef struct
+{
+	int ref;
+	int32_t data[FB_CANVAS_TILE * FB_CANVAS_TILE];
+} canvas_tile;
+
+typedef struct
+{
+	int index;
+	canvas_tile *before;
+	canvas_tile *after; /*撤销时才保存, 重做用*/
+} canvas_change;
+
+typedef struct
+{
+	int num, cap;
+	canvas_change *change;
+} canvas_step;
+
+struct fb_canvas
+{
+	fb_image *target;
+	int tw, th; /*块的列数和行数*/
+	int max_bytes;
+	int bytes; /*所有块内容占用的内存*/
+	canvas_tile **base; /*第一次改动前的样子, 没改过为NULL*/
+	canvas_tile **state; /*和目标图片里一样的内容, 不知道时为NULL*/
+	unsigned char *dirty; /*在正在记录的一步里改过*/
+	canvas_step *open; /*正在记录的一步*/
+	canvas_step **step;
+	int step_num, step_cap;
+	int cur; /*step[0..cur)已做, step[cur..step_num)可以重做*/
+};
+
+static canvas_tile *_tile_ref(canvas_tile *t)
+{
+	if (t != NULL) t->ref++;
+	return t;
+}
+
+static void _tile_unref(fb_canvas *c, canvas_tile *t)
+{
+	if ((t != NULL) && (--t->ref == 0))
+	{
+		c->bytes -= sizeof(canvas_tile);
+		free(t);
+	}
+}
+
+/*块i在目标图片中的位置*/
+static void _canvas_tile_rect(fb_canvas *c, int i, int *x, int *y, int *w, int *h)
+{
+	*x = (i % c->tw) * FB_CANVAS_TILE;
+	*y = (i / c->tw) * FB_CANVAS_TILE;
+	*w = (c->target->pixel_w - *x < FB_CANVAS_TILE) ? c->target->pixel_w - *x : FB_CANVAS_TILE;
+	*h = (c->target->pixel_h - *y < FB_CANVAS_TILE) ? c->target->pixel_h - *y : FB_CANVAS_TILE;
+}
+
+/*返回块i当前内容的一个引用; 已知时直接共享*/
+static canvas_tile *_tile_save(fb_canvas *c, int i)
+{
+	if (c->state[i] != NULL)
+	{
+		return _tile_ref(c->state[i]);
+	}
+	canvas_tile *t = (canvas_tile *)malloc(sizeof(canvas_tile));
+	if (t == NULL)
+	{
+		return NULL;
+	}
+	int x, y, w, h;
+	_canvas_tile_rect(c, i, &x, &y, &w, &h);
+	for (int row = 0; row < h; row++)
+	{
+		memcpy(t->data + row * FB_CANVAS_TILE, c->target->content + (y + row) * c->target->line_byte + x * 4, w * 4);
+	}
+	t->ref = 1;
+	c->bytes += sizeof(canvas_tile);
+	c->state[i] = _tile_ref(t);
+	return t;
+}
+
+static void _tile_restore(fb_canvas *c, int i, canvas_tile *t)
+{
+	int x, y, w, h;
+	if (t == NULL)
+	{
+		return;
+	}
+	_canvas_tile_rect(c, i, &x, &y, &w, &h);
+	if (c->target == &SCREEN_IMAGE) _begin_draw(x, y, w, h);
+	for (int row = 0; row < h; row++)
+	{
+		memcpy(c->target->content + (y + row) * c->target->line_byte + x * 4, t->data + row * FB_CANVAS_TILE, w * 4);
+	}
+	_tile_ref(t);
+	_tile_unref(c, c->state[i]);
+	c->state[i] = t;
+}
+
+static void _step_free(fb_canvas *c, canvas_step *s)
+{
+	for (int k = 0; k < s->num; k++)
+	{
+		_tile_unref(c, s->change[k].before);
+		_tile_unref(c, s->change[k].after);
+	}
+	free(s->change);
+	free(s);
+}
+
+static int _step_add(canvas_step *s, int index, canvas_tile *before, canvas_tile *after)
+{
+	if (s->num == s->cap)
+	{
+		int cap = s->cap ? s->cap * 2 : 16;
+		canvas_change *n = (canvas_change *)realloc(s->change, cap * sizeof(canvas_change));
+		if (n == NULL)
+		{
+			return -1;
+		}
+		s->change = n;
+		s->cap = cap;
+	}
+	s->change[s->num].index = index;
+	s->change[s->num].before = before;
+	s->change[s->num].after = after;
+	s->num++;
+	return 0;
+}
+
+/*开始记录新的一步: 不能再重做了*/
+static canvas_step *_canvas_begin(fb_canvas *c)
+{
+	if (c->open == NULL)
+	{
+		while (c->step_num > c->cur)
+		{
+			_step_free(c, c->step[--c->step_num]);
+		}
+		c->open = (canvas_step *)calloc(1, sizeof(canvas_step));
+	}
+	return c->open;
+}
+
+fb_canvas *fb_canvas_new(fb_image *target, int history_bytes)
+{
+	if ((target == NULL) || (fb_color_bytes(target->color_type) != 4))
+	{
+		return NULL;
+	}
+	fb_canvas *c = (fb_canvas *)calloc(1, sizeof(fb_canvas));
+	if (c == NULL)
+	{
+		return NULL;
+	}
+	c->target = target;
+	c->tw = (target->pixel_w + FB_CANVAS_TILE - 1) / FB_CANVAS_TILE;
+	c->th = (target->pixel_h + FB_CANVAS_TILE - 1) / FB_CANVAS_TILE;
+	c->max_bytes = history_bytes;
+	c->base = (canvas_tile **)calloc(c->tw * c->th, sizeof(canvas_tile *));
+	c->state = (canvas_tile **)calloc(c->tw * c->th, sizeof(canvas_tile *));
+	c->dirty = (unsigned char *)calloc(c->tw * c->th, 1);
+	if ((c->base == NULL) || (c->state == NULL) || (c->dirty == NULL))
+	{
+		fb_canvas_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void fb_canvas_free(fb_canvas *c)
+{
+	if (c == NULL)
+	{
+		return;
+	}
+	if (c->open != NULL)
+	{
+		_step_free(c, c->open);
+	}
+	for (int k = 0; k < c->step_num; k++)
+	{
+		_step_free(c, c->step[k]);
+	}
+	for (int i = 0; (c->base != NULL) && (c->state != NULL) && (i < c->tw * c->th); i++)
+	{
+		_tile_unref(c, c->base[i]);
+		_tile_unref(c, c->state[i]);
+	}
+	free(c->step);
+	free(c->base);
+	free(c->state);
+	free(c->dirty);
+	free(c);
+}
+
+void fb_canvas_modify(fb_canvas *c, int x, int y, int w, int h)
+{
+	int tx1 = (x < 0) ? 0 : x / FB_CANVAS_TILE;
+	int ty1 = (y < 0) ? 0 : y / FB_CANVAS_TILE;
+	int tx2 = (x + w + FB_CANVAS_TILE - 1) / FB_CANVAS_TILE;
+	int ty2 = (y + h + FB_CANVAS_TILE - 1) / FB_CANVAS_TILE;
+	if (c == NULL)
+	{
+		return;
+	}
+	tx2 = (tx2 > c->tw) ? c->tw : tx2;
+	ty2 = (ty2 > c->th) ? c->th : ty2;
+	if ((w <= 0) || (h <= 0) || (tx1 >= tx2) || (ty1 >= ty2) || (_canvas_begin(c) == NULL))
+	{
+		return;
+	}
+	for (int ty = ty1; ty < ty2; ty++)
+	{
+		for (int tx = tx1; tx < tx2; tx++)
+		{
+			int i = ty * c->tw + tx;
+			if (c->dirty[i])
+			{
+				continue;
+			}
+			canvas_tile *before = _tile_save(c, i);
+			if ((before == NULL) || (_step_add(c->open, i, before, NULL) < 0))
+			{
+				_tile_unref(c, before);
+				continue; // 内存不够时这一块不能撤销
+			}
+			if (c->base[i] == NULL)
+			{
+				c->base[i] = _tile_ref(before);
+			}
+			c->dirty[i] = 1;
+			_tile_unref(c, c->state[i]); // 马上要被画掉
+			c->state[i] = NULL;
+		}
+	}
+}
+
+int fb_canvas_snapshot(fb_canvas *c)
+{
+	canvas_step *s = (c != NULL) ? c->open : NULL;
+	if (s == NULL)
+	{
+		return 0;
+	}
+	c->open = NULL;
+	for (int k = 0; k < s->num; k++)
+	{
+		c->dirty[s->change[k].index] = 0;
+	}
+	if (s->num == 0)
+	{
+		_step_free(c, s);
+		return 0;
+	}
+	if (c->step_num == c->step_cap)
+	{
+		int cap = c->step_cap ? c->step_cap * 2 : 16;
+		canvas_step **n = (canvas_step **)realloc(c->step, cap * sizeof(canvas_step *));
+		if (n == NULL)
+		{
+			_step_free(c, s);
+			return 0;
+		}
+		c->step = n;
+		c->step_cap = cap;
+	}
+	c->step[c->step_num++] = s;
+	c->cur = c->step_num;
+	/*超出内存限制时丢掉最早的几步; 最初的样子一直保留, fb_canvas_revert要用*/
+	while ((c->bytes > c->max_bytes) && (c->cur > 1))
+	{
+		_step_free(c, c->step[0]);
+		memmove(c->step, c->step + 1, (c->step_num - 1) * sizeof(canvas_step *));
+		c->step_num--;
+		c->cur--;
+	}
+	return 1;
+}
+
+int fb_canvas_undo(fb_canvas *c)
+{
+	if (c == NULL)
+	{
+		return 0;
+	}
+	fb_canvas_snapshot(c);
+	if (c->cur == 0)
+	{
+		return 0;
+	}
+	canvas_step *s = c->step[--c->cur];
+	for (int k = s->num - 1; k >= 0; k--)
+	{
+		canvas_change *ch = &s->change[k];
+		if (ch->after == NULL)
+		{
+			ch->after = _tile_save(c, ch->index);
+		}
+		_tile_restore(c, ch->index, ch->before);
+	}
+	return 1;
+}
+
+int fb_canvas_redo(fb_canvas *c)
+{
+	if (c == NULL)
+	{
+		return 0;
+	}
+	fb_canvas_snapshot(c);
+	if (c->cur == c->step_num)
+	{
+		return 0;
+	}
+	canvas_step *s = c->step[c->cur++];
+	for (int k = 0; k < s->num; k++)
+	{
+		_tile_restore(c, s->change[k].index, s->change[k].after);
+	}
+	return 1;
+}
+
+int fb_canvas_revert(fb_canvas *c)
+{
+	if (c == NULL)
+	{
+		return 0;
+	}
+	fb_canvas_snapshot(c);
+	for (int i = 0; i < c->tw * c->th; i++)
+	{
+		if ((c->base[i] == NULL) || (c->state[i] == c->base[i]) || (_canvas_begin(c) == NULL))
+		{
+			continue;
+		}
+		canvas_tile *before = _tile_save(c, i);
+		if ((before == NULL) || (_step_add(c->open, i, before, c->base[i]) < 0))
+		{
+			_tile_unref(c, before);
+			continue;
+		}
+		_tile_ref(c->base[i]);
+		c->dirty[i] = 1;
+		_tile_restore(c, i, c->base[i]);
+	}
+	return fb_canvas_snapshot(c);
+}
+
+/*level>0放大2^level倍, level<0缩小2^-level倍, 一次完成*/
+fb_image* zoom_image(const fb_image *img, int level)
+{
+	if (img == NULL)
+	{
+		return NULL;
+	}
+	int w = img->pixel_w, h = img->pixel_h;
+	if (level >= 0)
+	{
+		if (level > 8)
+		{
+			return NULL;
+		}
+		w <<= level;
+		h <<= level;
+	}
+	else
+	{
+		w >>= -level;
+		h >>= -level;
+	}
+	return fb_scale_image(img, w, h, (level > 0) ? FB_FILTER_BILINEAR : FB_FILTER_BOX);
+}
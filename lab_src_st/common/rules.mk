@@ -11,11 +11,12 @@ CROSS_COMPILE := #$(NDK_DIR)/toolchains/arm-linux-androideabi-4.6/prebuilt/linux
 CC:=$(CROSS_COMPILE)gcc
 STRIP:=$(CROSS_COMPILE)strip
 
+CFLAGS := -O2
 #CFLAGS:=--sysroot=$(NDK_DIR)/platforms/android-9/arch-arm -march=armv7-a -mfloat-abi=softfp -mfpu=neon -Wall
 #LDFLAGS:=--sysroot=$(NDK_DIR)/platforms/android-9/arch-arm -march=armv7-a -mfloat-abi=softfp -mfpu=neon -Wall
 
 INCLUDE := -I../common/external/include
-LIB :=   -ljpeg -lfreetype -lpng -lz -lm # ../common/external/lib/libturbojpeg.a ../common/external/lib/libfreetype.a ../common/external/lib/libpng12.a -lz -lm
+LIB :=   -ljpeg -lfreetype -lpng -lz -lm -lpthread # ../common/external/lib/libturbojpeg.a ../common/external/lib/libfreetype.a ../common/external/lib/libpng12.a -lz -lm
 
 EXESRCS := ../common/graphic.c ../common/touch.c ../common/external.c ../common/task.c $(EXESRCS)
 EXEOBJS := $(patsubst %.c, %.o, $(EXESRCS))
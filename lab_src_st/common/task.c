@@ -68,6 +68,209 @@ int myWrite_nonblock(int fd, void *p, int n)
 
 /*===============================================*/
 
+#define WORKER_NUM_MAX	4
+
+/* 工作线程第一次task_parallel时创建, 之后一直留着, 每一帧的并行绘制不再创建/回收线程.
+ * 同一时刻只执行一个并行任务, 其它线程同时调用时在自己的线程上依次执行. */
+
+typedef struct {
+	int n;
+	int next; /*下一个待领取的任务*/
+	int *queue; /*已完成的任务, 由调用线程取出*/
+	int q_head, q_tail;
+	int active; /*正在处理这个任务的工作线程数*/
+	Task_Work work;
+	void *arg;
+} parallel_job;
+
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER; /*正在执行并行任务*/
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; /*保护pool_job和其中的计数*/
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER; /*有新任务*/
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER; /*完成了一项, 或有线程离开任务*/
+static parallel_job *pool_job;
+static int pool_num = -1; /*工作线程数, -1表示还没创建*/
+
+static void *_parallel_worker(void *p)
+{
+	parallel_job *job;
+	int i;
+	(void)p;
+	pthread_mutex_lock(&pool_lock);
+	while(1)
+	{
+		while((pool_job == NULL)||(pool_job->next >= pool_job->n))
+			pthread_cond_wait(&pool_wake, &pool_lock);
+		job = pool_job;
+		job->active++;
+		while((i = job->next) < job->n)
+		{
+			job->next++;
+			pthread_mutex_unlock(&pool_lock);
+			job->work(i, job->arg);
+			pthread_mutex_lock(&pool_lock);
+			job->queue[job->q_tail++] = i;
+			pthread_cond_signal(&pool_done);
+		}
+		job->active--;
+		pthread_cond_signal(&pool_done);
+	}
+	return NULL;
+}
+
+/*持有pool_busy时调用*/
+static void _pool_start(void)
+{
+	pthread_t thread;
+	int num = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num > WORKER_NUM_MAX) num = WORKER_NUM_MAX;
+	pool_num = 0;
+	if(num <= 1) return; /*单核时在调用线程上执行*/
+	while(pool_num < num)
+	{
+		if(pthread_create(&thread, NULL, _parallel_worker, NULL) != 0) {
+			printf("task_parallel create thread failed\n");
+			break;
+		}
+		pthread_detach(thread);
+		pool_num++;
+	}
+}
+
+void task_parallel(int n, Task_Work work, Task_Work done, void *arg)
+{
+	parallel_job job;
+	int i, finished;
+
+	if((n <= 0)||(work == NULL)) return;
+
+	job.queue = NULL;
+	if((n > 1)&&(pthread_mutex_trylock(&pool_busy) == 0)) {
+		if(pool_num < 0) _pool_start();
+		if(pool_num > 0) job.queue = (int *)malloc(n*sizeof(int));
+		if(job.queue == NULL) pthread_mutex_unlock(&pool_busy);
+	}
+	if(job.queue == NULL) { /*单核, 内存不足或线程池正忙时在本线程依次执行*/
+		for(i=0; i<n; ++i) {
+			work(i, arg);
+			if(done) done(i, arg);
+		}
+		return;
+	}
+	job.n = n;
+	job.next = 0;
+	job.q_head = job.q_tail = 0;
+	job.active = 0;
+	job.work = work;
+	job.arg = arg;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_job = &job;
+	pthread_cond_broadcast(&pool_wake);
+	for(finished=0; finished<n; ++finished)
+	{
+		while(job.q_head == job.q_tail)
+			pthread_cond_wait(&pool_done, &pool_lock);
+		i = job.queue[job.q_head++];
+		if(done) {
+			pthread_mutex_unlock(&pool_lock);
+			done(i, arg);
+			pthread_mutex_lock(&pool_lock);
+		}
+	}
+	pool_job = NULL;
+	while(job.active > 0) /*job在栈上, 等所有工作线程都离开*/
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+	pthread_mutex_unlock(&pool_busy);
+	free(job.queue);
+}
+
+/*===============================================*/
+
+typedef struct post_job {
+	Task_Work work;
+	Task_Work done;
+	int index;
+	void *arg;
+	struct post_job *next;
+} post_job;
+
+static post_job *post_head, *post_tail;
+static pthread_mutex_t post_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t post_cond = PTHREAD_COND_INITIALIZER;
+static int post_pipe[2] = {-1, -1}; /*工作线程把完成的任务写入管道, 主线程在task_loop里取出*/
+static int post_pending = 0; /*已提交还没在主线程上完成的任务数, 只在主线程访问*/
+
+static void *_post_worker(void *p)
+{
+	post_job *job;
+	(void)p;
+	while(1)
+	{
+		pthread_mutex_lock(&post_lock);
+		while(post_head == NULL)
+			pthread_cond_wait(&post_cond, &post_lock);
+		job = post_head;
+		post_head = job->next;
+		if(post_head == NULL) post_tail = NULL;
+		pthread_mutex_unlock(&post_lock);
+
+		job->work(job->index, job->arg);
+		while((write(post_pipe[1], &job, sizeof(job)) < 0) && (errno == EINTR));
+	}
+	return NULL;
+}
+
+static void _post_done(int fd)
+{
+	post_job *job;
+	if(read(fd, &job, sizeof(job)) != sizeof(job)) return;
+	post_pending--;
+	if(job->done) job->done(job->index, job->arg);
+	free(job);
+}
+
+int task_post(Task_Work work, Task_Work done, int index, void *arg)
+{
+	pthread_t thread;
+	post_job *job;
+
+	if(work == NULL) return -1;
+	if(post_pipe[0] == -1) { /*第一次使用时创建管道和后台线程*/
+		if(pipe(post_pipe) < 0) {
+			printf("task_post pipe error(%d): %s\n", errno, strerror(errno));
+			return -1;
+		}
+		if(pthread_create(&thread, NULL, _post_worker, NULL) != 0) {
+			printf("task_post create thread failed\n");
+			close(post_pipe[0]);
+			close(post_pipe[1]);
+			post_pipe[0] = post_pipe[1] = -1;
+			return -1;
+		}
+		pthread_detach(thread);
+		task_add_file(post_pipe[0], _post_done);
+	}
+
+	job = (post_job *)malloc(sizeof(post_job));
+	if(job == NULL) return -1;
+	job->work = work;
+	job->done = done;
+	job->index = index;
+	job->arg = arg;
+	job->next = NULL;
+	pthread_mutex_lock(&post_lock);
+	if(post_tail) post_tail->next = job;
+	else post_head = job;
+	post_tail = job;
+	post_pending++;
+	pthread_cond_signal(&post_cond);
+	pthread_mutex_unlock(&post_lock);
+	return 0;
+}
+
+/*===============================================*/
+
 typedef struct {
 	int fd;
 	Task_Func callback;
@@ -247,9 +450,23 @@ static void _check_and_do_task(void)
 	return;
 }
 
+/*还有没有要等的任务; task_post的管道在没有未完成任务时不算*/
+static int _has_task(void)
+{
+	int i;
+	for(i=0; i<TIMER_NUM_MAX; ++i)
+		if(timers[i].callback != NULL) return 1;
+	for(i=0; i<FILE_NUM_MAX; ++i)
+	{
+		if(files[i].callback == NULL) continue;
+		if((files[i].fd != post_pipe[0]) || (post_pending > 0)) return 1;
+	}
+	return 0;
+}
+
 void task_loop(void)
 {
-	while(1) {
+	while(_has_task()) {
 		_check_and_do_task();
 	}
 	return;
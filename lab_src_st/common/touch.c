@@ -7,26 +7,685 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <math.h>
 
-static struct finger_info
+#ifndef EVIOCSCLOCKID
+#define EVIOCSCLOCKID _IOW('E', 0xa0, int) /* set clockid to be used for timestamps */
+#endif
+#ifndef EVIOCGMTSLOTS
+#define EVIOCGMTSLOTS(len) _IOC(_IOC_READ, 'E', 0x0a, len) /* get MT slot values */
+#endif
+
+/*============================ 设备 ============================*/
+
+/*每个touch_fd一份解析状态, 几块触摸屏可以各自用task_add_file加进任务循环, 手指编号按设备各算各的.
+  原始坐标到屏幕坐标的映射在打开设备时按EVIOCGABS读到的范围算好, 每个事件只做乘法和移位*/
+#define TOUCH_DEV_MAX 4
+#define TOUCH_RANGE_DEFAULT 4096 // 读不到范围时(回放的管道)按老驱动的[0,4096)
+#define TOUCH_SCAN_MAX 16 // touch_open_all查看的/dev/input/event*个数
+
+typedef struct
 {
-    int x;
-    int y;
+    int src;       // 取原始坐标的哪个轴: 0是x, 1是y
+    long long mul; // 16.16定点的比例, 翻转时是负数
+    long long add;
+    int max;       // 屏幕坐标的最大值
+} touch_axis;
+
+typedef struct
+{
+    int raw[2]; // 原始坐标
     int event;
-} infos[FINGER_NUM_MAX];
-static int cur_slot = 0;
+} finger_info;
+
+typedef struct
+{
+    int used;
+    int fd;
+    struct replay_info *replay; // 是回放管道的读端时: 回放线程, touch_close时停掉它
+    long long clock_offset; // 事件时间戳减去它得到CLOCK_MONOTONIC的时间
+    int min[2], max[2];     // 原始坐标的范围
+    int orient;             // FB_ORIENT_*
+    touch_axis axis[2];     // 屏幕的x, y
+    /*touch_read*/
+    finger_info infos[FINGER_NUM_MAX];
+    int cur_slot;
+    /*touch_read_frame*/
+    struct input_event frame_buf[TOUCH_READ_EVENTS];
+    int frame_buf_pos, frame_buf_num;
+    touch_frame frame_state;
+    int frame_raw[FINGER_NUM_MAX][2];
+    int frame_slot;     // -1表示当前槽超出FINGER_NUM_MAX, 忽略它的事件
+    int frame_dropping; // 收到SYN_DROPPED, 正在丢弃不完整的事件
+    /*touch_read_coalesced*/
+    touch_frame held_frame; // 不能合并的帧留到下一次返回
+    int held_valid;
+} touch_dev;
+
+static touch_dev devs[TOUCH_DEV_MAX];
+
+/*按范围和方向算出两个轴的定点系数*/
+static void _dev_update_map(touch_dev *d)
+{
+    /*每种方向: 屏幕x,y是否交换原始轴, 屏幕x是否翻转, 屏幕y是否翻转*/
+    static const char tab[9][3] = {
+        {0, 0, 0}, {0, 0, 0}, {0, 1, 0}, {0, 1, 1}, {0, 0, 1},
+        {1, 0, 0}, {1, 1, 0}, {1, 1, 1}, {1, 0, 1}};
+    const char *t = tab[(d->orient >= 1 && d->orient <= 8) ? d->orient : FB_ORIENT_NORMAL];
+    for (int k = 0; k < 2; k++)
+    {
+        touch_axis *a = &d->axis[k];
+        int len = (k == 0) ? SCREEN_WIDTH : SCREEN_HEIGHT;
+        a->src = t[0] ? 1 - k : k;
+        long long mul = ((long long)len << 16) / (d->max[a->src] - d->min[a->src] + 1);
+        if (t[1 + k])
+        {
+            a->mul = -mul; // (max - raw) * mul
+            a->add = d->max[a->src] * mul;
+        }
+        else
+        {
+            a->mul = mul; // (raw - min) * mul
+            a->add = -d->min[a->src] * mul;
+        }
+        a->max = len - 1;
+    }
+}
+
+static int _axis_map(const touch_axis *a, const int raw[2])
+{
+    long long v = (raw[a->src] * a->mul + a->add) >> 16;
+    return (v < 0) ? 0 : (v > a->max) ? a->max : (int)v;
+}
+
+/*取fd的状态, 不是touch_init, touch_open_all或touch_thread_start打开的fd时返回NULL*/
+static touch_dev *_dev_find(int fd)
+{
+    for (int i = 0; i < TOUCH_DEV_MAX; i++)
+    {
+        if (devs[i].used && devs[i].fd == fd)
+        {
+            return &devs[i];
+        }
+    }
+    return NULL;
+}
+
+/*读写接口用: 不认识的fd打印出来, 返回NULL*/
+static touch_dev *_dev_check(int fd, const char *func)
+{
+    touch_dev *d = _dev_find(fd);
+    if (d == NULL)
+    {
+        printf("%s: fd %d is not an opened touch device\n", func, fd);
+    }
+    return d;
+}
+
+/*按默认范围新建一份状态. fd被关掉后编号可能被新打开的设备重用, 打开时总是从头开始; 表满时返回NULL*/
+static touch_dev *_dev_new(int fd)
+{
+    touch_dev *d = _dev_find(fd);
+    for (int i = 0; (d == NULL) && (i < TOUCH_DEV_MAX); i++)
+    {
+        if (!devs[i].used)
+        {
+            d = &devs[i];
+        }
+    }
+    if (d == NULL)
+    {
+        printf("touch: too many devices, at most %d\n", TOUCH_DEV_MAX);
+        return NULL;
+    }
+    char *env = getenv("TOUCH_ORIENT");
+    memset(d, 0, sizeof(*d));
+    d->used = 1;
+    d->fd = fd;
+    d->max[0] = d->max[1] = TOUCH_RANGE_DEFAULT - 1;
+    d->orient = (env != NULL) ? atoi(env) : FB_ORIENT_NORMAL;
+    _dev_update_map(d);
+    return d;
+}
+
+int touch_set_orient(int touch_fd, int orient)
+{
+    touch_dev *d = _dev_check(touch_fd, "touch_set_orient");
+    if (d == NULL || orient < 1 || orient > 8)
+    {
+        return -1;
+    }
+    d->orient = orient;
+    _dev_update_map(d);
+    return 0;
+}
+
+int touch_set_range(int touch_fd, int min_x, int max_x, int min_y, int max_y)
+{
+    touch_dev *d = _dev_check(touch_fd, "touch_set_range");
+    if (d == NULL || max_x <= min_x || max_y <= min_y)
+    {
+        return -1;
+    }
+    d->min[0] = min_x;
+    d->max[0] = max_x;
+    d->min[1] = min_y;
+    d->max[1] = max_y;
+    _dev_update_map(d);
+    return 0;
+}
+
+/*把事件的时间戳换成CLOCK_MONOTONIC的微秒数*/
+static long long _event_time(const touch_dev *d, const struct input_event *data)
+{
+    return (long long)data->time.tv_sec * 1000000 + data->time.tv_usec - d->clock_offset;
+}
 
+/*============================ 回放 ============================*/
+
+/*touchrec录下的文件(或写入同样格式的管道)是原始input_event序列. 回放线程按时间戳的
+  间隔把事件写进一个管道, touch_fd就是管道的读端, 应用感觉不出区别.
+  事件的时间戳换成写入时刻, 延迟统计照常工作*/
+typedef struct replay_info {
+    int src;  // 录像文件
+    int out;  // 管道写端, 非阻塞
+    int peer; // 管道读端, 快速回放时用来判断应用是否已经取走
+    int fast;
+    int quit; // touch_close用来叫醒回放线程的eventfd
+    pthread_t thread;
+} replay_info;
+
+/*等ms毫秒(-1表示一直等), fd不小于0时等到它可写为止. touch_close叫停时返回-1*/
+static int _replay_wait(replay_info *r, int fd, int ms)
+{
+    struct pollfd pfd[2] = {{r->quit, POLLIN, 0}, {fd, POLLOUT, 0}};
+    poll(pfd, (fd >= 0) ? 2 : 1, ms);
+    return (pfd[0].revents & POLLIN) ? -1 : 0;
+}
+
+static void *_replay_thread(void *p)
+{
+    replay_info *r = (replay_info *)p;
+    struct input_event data;
+    long long first = -1, start = 0;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE); // 应用关掉读端后write返回EPIPE, 而不是杀掉进程
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    while (read(r->src, &data, sizeof(data)) == sizeof(data))
+    {
+        long long t = (long long)data.time.tv_sec * 1000000 + data.time.tv_usec;
+        int n;
+        if (first < 0)
+        {
+            first = t;
+            start = fb_time_us();
+        }
+        long long now = fb_time_us();
+        if (!r->fast && (start + (t - first) > now) &&
+            (_replay_wait(r, -1, (int)((start + (t - first) - now + 999) / 1000)) < 0))
+        {
+            break; // 按录制时的节奏, 等待中被touch_close叫停
+        }
+        now = fb_time_us();
+        data.time.tv_sec = now / 1000000;
+        data.time.tv_usec = now % 1000000;
+        while (((n = write(r->out, &data, sizeof(data))) < 0) && (errno == EAGAIN) && (_replay_wait(r, r->out, -1) == 0))
+        {
+            // 管道满了, 等应用取走
+        }
+        if (n != sizeof(data))
+        {
+            break; // 应用已经关掉了touch_fd
+        }
+        if (r->fast && (data.type == EV_SYN) && (data.code == SYN_REPORT))
+        {
+            int pending;
+            while ((ioctl(r->peer, FIONREAD, &pending) == 0) && (pending > 0) && (_replay_wait(r, -1, 0) == 0))
+            {
+                usleep(100); // 尽快回放, 但一次只给一帧, 结果才可重复
+            }
+        }
+    }
+    close(r->src);
+    close(r->out); // 应用读到文件结束, 当作设备断开; r由touch_close等线程退出后释放
+    return NULL;
+}
+
+/*叫停回放线程, 等它退出后才能关掉它还在用的管道读端*/
+static void _replay_stop(replay_info *r)
+{
+    uint64_t one = 1;
+    write(r->quit, &one, sizeof(one));
+    pthread_join(r->thread, NULL);
+    close(r->quit);
+    free(r);
+}
+
+static int _replay_open(char *file)
+{
+    int fds[2] = {-1, -1};
+    replay_info *r = (replay_info *)malloc(sizeof(replay_info));
+    if (r == NULL)
+    {
+        return -1;
+    }
+    r->src = open(file, O_RDONLY);
+    if (r->src < 0)
+    {
+        printf("touch_init open replay %s error!errno = %d\n", file, errno);
+        free(r);
+        return -1;
+    }
+    r->quit = eventfd(0, EFD_NONBLOCK);
+    if ((r->quit < 0) || (pipe(fds) < 0))
+    {
+        printf("touch_init replay pipe error!errno = %d\n", errno);
+        close(r->src);
+        if (r->quit >= 0)
+        {
+            close(r->quit);
+        }
+        free(r);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK); // 管道满时回放线程等可写, 同时能被叫停
+    r->out = fds[1];
+    r->peer = fds[0];
+    r->fast = (getenv("TOUCH_REPLAY_FAST") != NULL);
+    touch_dev *d = _dev_new(fds[0]); // 回放线程写入的就是CLOCK_MONOTONIC时刻, clock_offset为0
+    if ((d == NULL) || (pthread_create(&r->thread, NULL, _replay_thread, r) != 0))
+    {
+        if (d != NULL)
+        {
+            printf("touch_init create replay thread failed\n");
+            d->used = 0;
+        }
+        close(r->src);
+        close(r->quit);
+        close(fds[0]);
+        close(fds[1]);
+        free(r);
+        return -1;
+    }
+    d->replay = r;
+    printf("touch_init replay %s%s\n", file, r->fast ? " (fast)" : "");
+    return fds[0];
+}
+
+/*设置时钟, 读坐标范围*/
+static touch_dev *_dev_open(int fd)
+{
+    touch_dev *d = _dev_new(fd);
+    struct input_absinfo abs[2];
+    if (d == NULL)
+    {
+        return NULL;
+    }
+    // 让内核用CLOCK_MONOTONIC打时间戳, 才能和fb_update的时刻相减; 老内核不支持时按当前的差值换算
+    int clk = CLOCK_MONOTONIC;
+    if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+    {
+        struct timespec rt, mono;
+        clock_gettime(CLOCK_REALTIME, &rt);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        d->clock_offset = ((long long)rt.tv_sec - mono.tv_sec) * 1000000 + (rt.tv_nsec - mono.tv_nsec) / 1000;
+    }
+    if ((ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &abs[0]) == 0) &&
+        (ioctl(fd, EVIOCGABS(ABS_MT_POSITION_Y), &abs[1]) == 0) &&
+        (abs[0].maximum > abs[0].minimum) && (abs[1].maximum > abs[1].minimum))
+    {
+        touch_set_range(fd, abs[0].minimum, abs[0].maximum, abs[1].minimum, abs[1].maximum);
+    }
+    return d;
+}
+
+/*dev不是字符设备时回放, 见common.h*/
 int touch_init(char *dev)
 {
-    int fd = open(dev, O_RDONLY);
+    struct stat st;
+    char *env = getenv("TOUCH_DEV");
+    if (env != NULL)
+    {
+        dev = env;
+    }
+    if ((stat(dev, &st) == 0) && !S_ISCHR(st.st_mode))
+    {
+        return _replay_open(dev);
+    }
+    int fd = open(dev, O_RDONLY | O_NONBLOCK); // 可读时才读, 非阻塞方便一次读空
     if (fd < 0)
     {
         printf("touch_init open %s error!errno = %d\n", dev, errno);
         return -1;
     }
+    if (_dev_open(fd) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
     return fd;
 }
 
+int touch_open_all(Task_Func callback)
+{
+    char path[32];
+    int num = 0;
+    if (getenv("TOUCH_DEV") != NULL)
+    {
+        int fd = touch_init(NULL); // 用环境变量指定的设备或录像
+        if (fd < 0)
+        {
+            return 0;
+        }
+        task_add_file(fd, callback);
+        return 1;
+    }
+    for (int i = 0; (i < TOUCH_SCAN_MAX) && (num < TOUCH_DEV_MAX); i++)
+    {
+        struct input_absinfo abs;
+        sprintf(path, "/dev/input/event%d", i);
+        int fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+        {
+            continue;
+        }
+        // 键盘, 鼠标等没有多点触摸的坐标轴
+        if ((ioctl(fd, EVIOCGABS(ABS_MT_POSITION_X), &abs) < 0) || (abs.maximum <= abs.minimum) ||
+            (_dev_open(fd) == NULL))
+        {
+            close(fd);
+            continue;
+        }
+        printf("touch_open_all: %s\n", path);
+        task_add_file(fd, callback);
+        num++;
+    }
+    if (num == 0)
+    {
+        printf("touch_open_all: no touch device\n");
+    }
+    return num;
+}
+
+/*============================ 丢事件后的重新同步 ============================*/
+
+/*内核缓冲满了会发SYN_DROPPED, 之后到下一个SYN_REPORT的事件都不完整. 这时用EVIOCGMTSLOTS
+  读回每个槽的当前状态, 生成等效的事件序列写入out(至少RESYNC_EVENTS_MAX个), 返回事件数.
+  down[i]是丢失前槽i是否按着, 只在变化时生成TRACKING_ID, 不会多出一次按下; 返回时更新成当前状态*/
+#define RESYNC_EVENTS_MAX (FINGER_NUM_MAX * 4 + 2)
+
+static int _resync_events(int fd, long long clock_offset, int *down, struct input_event *out)
+{
+    static const int codes[3] = {ABS_MT_TRACKING_ID, ABS_MT_POSITION_X, ABS_MT_POSITION_Y};
+    struct
+    {
+        __u32 code;
+        __s32 values[FINGER_NUM_MAX];
+    } mt[3];
+    struct input_absinfo abs;
+    for (int k = 0; k < 3; k++)
+    {
+        mt[k].code = codes[k];
+        if (ioctl(fd, EVIOCGMTSLOTS(sizeof(mt[k])), &mt[k]) < 0)
+        {
+            return 0; // 不是evdev设备(例如回放的管道), 没法同步
+        }
+    }
+    if (ioctl(fd, EVIOCGABS(ABS_MT_SLOT), &abs) < 0)
+    {
+        abs.value = 0;
+    }
+    long long now = fb_time_us() + clock_offset; // 和内核时间戳用同一个时钟
+    int n = 0;
+#define RESYNC_EVENT(t, c, v) do { \
+        out[n].time.tv_sec = now / 1000000; out[n].time.tv_usec = now % 1000000; \
+        out[n].type = (t); out[n].code = (c); out[n].value = (v); n++; \
+    } while (0)
+    for (int i = 0; i < FINGER_NUM_MAX; i++)
+    {
+        int id = mt[0].values[i];
+        RESYNC_EVENT(EV_ABS, ABS_MT_SLOT, i);
+        if ((id >= 0) != (down[i] != 0))
+        {
+            RESYNC_EVENT(EV_ABS, ABS_MT_TRACKING_ID, id);
+            down[i] = (id >= 0);
+        }
+        if (id >= 0)
+        {
+            RESYNC_EVENT(EV_ABS, ABS_MT_POSITION_X, mt[1].values[i]);
+            RESYNC_EVENT(EV_ABS, ABS_MT_POSITION_Y, mt[2].values[i]);
+        }
+    }
+    RESYNC_EVENT(EV_ABS, ABS_MT_SLOT, abs.value); // 后面的事件接着用设备当前的槽
+    RESYNC_EVENT(EV_SYN, SYN_REPORT, 0);
+#undef RESYNC_EVENT
+    return n;
+}
+
+/*============================ 输入线程 ============================*/
+
+/*输入线程是唯一的生产者, 主线程是唯一的消费者, head/tail各由一方写, 不用加锁*/
+static struct
+{
+    struct input_event ev[TOUCH_RING_SIZE];
+    unsigned int head; // 生产者写
+    unsigned int tail; // 消费者写
+    int ended;         // 设备断开
+    int src;           // 真正的touch_fd
+    long long clock_offset;
+    int efd;           // 通知主线程的eventfd
+    int quit;          // touch_close用来叫醒输入线程的eventfd
+    int stop;
+    pthread_t thread;
+} ring = {.efd = -1, .quit = -1};
+
+static void _ring_push(const struct input_event *ev, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        unsigned int head = ring.head;
+        while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >= TOUCH_RING_SIZE)
+        {
+            if (__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE))
+            {
+                return; // touch_close了, 主线程不会再来取
+            }
+            usleep(1000); // 满了就等主线程取走, 这时事件积在内核里, 真溢出了再靠SYN_DROPPED同步
+        }
+        ring.ev[head & (TOUCH_RING_SIZE - 1)] = ev[i];
+        __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void *_input_thread(void *p)
+{
+    struct input_event buf[TOUCH_READ_EVENTS], sync[RESYNC_EVENTS_MAX];
+    struct pollfd pfd[2] = {{ring.src, POLLIN, 0}, {ring.quit, POLLIN, 0}};
+    int down[FINGER_NUM_MAX] = {0}, slot = 0, dropping = 0;
+    uint64_t one = 1;
+    (void)p;
+    while (!__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE))
+    {
+        int n = read(ring.src, buf, sizeof(buf));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            poll(pfd, 2, -1);
+            continue;
+        }
+        if (n <= 0 || n % sizeof(struct input_event) != 0)
+        {
+            break;
+        }
+        n /= sizeof(struct input_event);
+        int start = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct input_event *e = &buf[i];
+            if (e->type == EV_SYN && e->code == SYN_DROPPED)
+            {
+                _ring_push(buf + start, i - start);
+                start = i + 1; // SYN_DROPPED不进环形缓冲, 主线程只会看到补上的当前状态
+                dropping = 1;
+                continue;
+            }
+            if (dropping)
+            {
+                start = i + 1;
+                if (e->type == EV_SYN && e->code == SYN_REPORT)
+                {
+                    dropping = 0;
+                    _ring_push(sync, _resync_events(ring.src, ring.clock_offset, down, sync));
+                }
+                continue;
+            }
+            if (e->type == EV_ABS && e->code == ABS_MT_SLOT)
+            {
+                slot = e->value;
+            }
+            else if (e->type == EV_ABS && e->code == ABS_MT_TRACKING_ID && slot >= 0 && slot < FINGER_NUM_MAX)
+            {
+                down[slot] = (e->value != -1);
+            }
+        }
+        _ring_push(buf + start, n - start);
+        write(ring.efd, &one, sizeof(one));
+    }
+    __atomic_store_n(&ring.ended, 1, __ATOMIC_RELEASE);
+    write(ring.efd, &one, sizeof(one));
+    return NULL;
+}
+
+/*关掉线程用的eventfd, 回到没有启动过的状态*/
+static void _ring_reset(void)
+{
+    if (ring.efd >= 0)
+    {
+        close(ring.efd);
+    }
+    if (ring.quit >= 0)
+    {
+        close(ring.quit);
+    }
+    ring.efd = ring.quit = -1;
+    ring.head = ring.tail = 0;
+    ring.ended = ring.stop = 0;
+}
+
+int touch_thread_start(int touch_fd)
+{
+    touch_dev *src = (touch_fd >= 0) ? _dev_check(touch_fd, "touch_thread_start") : NULL;
+    if (src == NULL || src->replay)
+    {
+        return (src != NULL) ? touch_fd : -1; // 回放线程已经在往管道里写, 快速回放还要靠它一帧一帧地给
+    }
+    if (ring.efd >= 0)
+    {
+        printf("touch_thread_start: input thread already started, only one device supported\n");
+        return -1;
+    }
+    ring.efd = eventfd(0, EFD_NONBLOCK);
+    ring.quit = eventfd(0, EFD_NONBLOCK);
+    touch_dev *d = (ring.efd >= 0 && ring.quit >= 0) ? _dev_new(ring.efd) : NULL;
+    if (d == NULL)
+    {
+        printf("touch_thread_start eventfd error!errno = %d\n", errno);
+        _ring_reset();
+        return -1;
+    }
+    // 事件还是设备的, 坐标映射跟着设备走
+    memcpy(d->min, src->min, sizeof(d->min));
+    memcpy(d->max, src->max, sizeof(d->max));
+    d->orient = src->orient;
+    d->clock_offset = src->clock_offset;
+    _dev_update_map(d);
+    ring.src = touch_fd;
+    ring.clock_offset = src->clock_offset;
+    if (pthread_create(&ring.thread, NULL, _input_thread, NULL) != 0)
+    {
+        printf("touch_thread_start create thread failed\n");
+        d->used = 0;
+        _ring_reset();
+        return -1;
+    }
+    return ring.efd; // 不detach, touch_close要等线程退出才能关掉它用的fd
+}
+
+int touch_close(int touch_fd)
+{
+    touch_dev *d = _dev_check(touch_fd, "touch_close");
+    if (d == NULL)
+    {
+        return -1;
+    }
+    if (ring.efd >= 0 && (touch_fd == ring.efd || touch_fd == ring.src))
+    {
+        uint64_t one = 1;
+        __atomic_store_n(&ring.stop, 1, __ATOMIC_RELEASE);
+        write(ring.quit, &one, sizeof(one));
+        pthread_join(ring.thread, NULL);
+        for (int i = 0; i < TOUCH_DEV_MAX; i++)
+        {
+            if (devs[i].used && (devs[i].fd == ring.efd || devs[i].fd == ring.src))
+            {
+                devs[i].used = 0;
+            }
+        }
+        close(ring.src); // 设备和eventfd一起关掉
+        _ring_reset();
+        return 0;
+    }
+    if (d->replay != NULL)
+    {
+        _replay_stop(d->replay);
+        d->replay = NULL;
+    }
+    d->used = 0;
+    close(touch_fd);
+    return 0;
+}
+
+/*代替read: fd是输入线程的eventfd时从环形缓冲取, 返回值和read一样*/
+static int _touch_fill(int fd, struct input_event *buf, int max)
+{
+    if (fd != ring.efd)
+    {
+        return read(fd, buf, max * sizeof(struct input_event));
+    }
+    uint64_t count;
+    read(fd, &count, sizeof(count)); // 先清零再取, 之后推进来的事件会再次唤醒
+    unsigned int tail = ring.tail;
+    unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (tail != head && n < max)
+    {
+        buf[n++] = ring.ev[tail++ & (TOUCH_RING_SIZE - 1)];
+    }
+    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+    if (n > 0)
+    {
+        if (tail != head)
+        {
+            uint64_t one = 1;
+            write(fd, &one, sizeof(one)); // 没取完, 下一轮接着取
+        }
+        return n * sizeof(struct input_event);
+    }
+    if (__atomic_load_n(&ring.ended, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
 /*return:
     TOUCH_NO_EVENT
     TOUCH_PRESS
@@ -38,16 +697,22 @@ int touch_init(char *dev)
     finger: 0,1,2,3,4
 */
 
-//驱动上传的xy坐标范围是[0,4096)
-#define ADJUST_X(n) ((n * SCREEN_WIDTH) >> 12)  /* (n*screen_width/4096) */
-#define ADJUST_Y(n) ((n * SCREEN_HEIGHT) >> 12) /* (n*screen_height/4096) */
-
 int touch_read(int touch_fd, int *x, int *y, int *finger)
 {
     struct input_event data;
     int n, ret;
-    if ((n = read(touch_fd, &data, sizeof(data))) != sizeof(data))
+    touch_dev *d = _dev_check(touch_fd, "touch_read");
+    if (d == NULL)
+    {
+        return TOUCH_ERROR;
+    }
+    finger_info *infos = d->infos;
+    if ((n = _touch_fill(touch_fd, &data, 1)) != sizeof(data))
     {
+        if (n < 0 && errno == EAGAIN)
+        {
+            return TOUCH_NO_EVENT;
+        }
         printf("touch_read error %d, errno=%d\n", n, errno);
         return TOUCH_ERROR;
     }
@@ -60,12 +725,13 @@ int touch_read(int touch_fd, int *x, int *y, int *finger)
         case ABS_MT_SLOT:
             if (data.value >= 0 && data.value < FINGER_NUM_MAX)
             {
-                int old = cur_slot;
-                cur_slot = data.value;
+                int old = d->cur_slot;
+                d->cur_slot = data.value;
                 if (infos[old].event != TOUCH_NO_EVENT)
                 {
-                    *x = infos[old].x;
-                    *y = infos[old].y;
+                    fb_latency_input(_event_time(d, &data));
+                    *x = _axis_map(&d->axis[0], infos[old].raw);
+                    *y = _axis_map(&d->axis[1], infos[old].raw);
                     *finger = old;
                     ret = infos[old].event;
                     infos[old].event = TOUCH_NO_EVENT;
@@ -76,29 +742,29 @@ int touch_read(int touch_fd, int *x, int *y, int *finger)
         case ABS_MT_TRACKING_ID:
             if (data.value == -1)
             {
-                *x = infos[cur_slot].x;
-                *y = infos[cur_slot].y;
-                *finger = cur_slot;
-                infos[cur_slot].event = TOUCH_NO_EVENT;
+                *x = _axis_map(&d->axis[0], infos[d->cur_slot].raw);
+                *y = _axis_map(&d->axis[1], infos[d->cur_slot].raw);
+                *finger = d->cur_slot;
+                infos[d->cur_slot].event = TOUCH_NO_EVENT;
                 return TOUCH_RELEASE;
             }
             else
             {
-                infos[cur_slot].event = TOUCH_PRESS;
+                infos[d->cur_slot].event = TOUCH_PRESS;
             }
             break;
         case ABS_MT_POSITION_X:
-            infos[cur_slot].x = ADJUST_X(data.value);
-            if (infos[cur_slot].event != TOUCH_PRESS)
+            infos[d->cur_slot].raw[0] = data.value;
+            if (infos[d->cur_slot].event != TOUCH_PRESS)
             {
-                infos[cur_slot].event = TOUCH_MOVE;
+                infos[d->cur_slot].event = TOUCH_MOVE;
             }
             break;
         case ABS_MT_POSITION_Y:
-            infos[cur_slot].y = ADJUST_Y(data.value);
-            if (infos[cur_slot].event != TOUCH_PRESS)
+            infos[d->cur_slot].raw[1] = data.value;
+            if (infos[d->cur_slot].event != TOUCH_PRESS)
             {
-                infos[cur_slot].event = TOUCH_MOVE;
+                infos[d->cur_slot].event = TOUCH_MOVE;
             }
             break;
         }
@@ -107,13 +773,14 @@ int touch_read(int touch_fd, int *x, int *y, int *finger)
         switch (data.code)
         {
         case SYN_REPORT:
-            if (infos[cur_slot].event != TOUCH_NO_EVENT)
+            if (infos[d->cur_slot].event != TOUCH_NO_EVENT)
             {
-                *x = infos[cur_slot].x;
-                *y = infos[cur_slot].y;
-                *finger = cur_slot;
-                ret = infos[cur_slot].event;
-                infos[cur_slot].event = TOUCH_NO_EVENT;
+                fb_latency_input(_event_time(d, &data));
+                *x = _axis_map(&d->axis[0], infos[d->cur_slot].raw);
+                *y = _axis_map(&d->axis[1], infos[d->cur_slot].raw);
+                *finger = d->cur_slot;
+                ret = infos[d->cur_slot].event;
+                infos[d->cur_slot].event = TOUCH_NO_EVENT;
                 return ret;
             }
             break;
@@ -122,3 +789,342 @@ int touch_read(int touch_fd, int *x, int *y, int *finger)
     }
     return TOUCH_NO_EVENT;
 }
+
+/*============================ 按帧读 ============================*/
+
+/*处理一个事件, 凑成一帧时返回1*/
+static int _frame_event(touch_dev *d, const struct input_event *data)
+{
+    long long time = _event_time(d, data);
+    touch_slot *s = (d->frame_slot >= 0) ? &d->frame_state.slot[d->frame_slot] : NULL;
+    switch (data->type)
+    {
+    case EV_ABS:
+        if (data->code == ABS_MT_SLOT)
+        {
+            d->frame_slot = (data->value >= 0 && data->value < FINGER_NUM_MAX) ? data->value : -1;
+            break;
+        }
+        if (s == NULL)
+        {
+            break;
+        }
+        switch (data->code)
+        {
+        case ABS_MT_TRACKING_ID:
+            if (data->value == -1)
+            {
+                if (s->down)
+                {
+                    s->down = 0;
+                    s->event = TOUCH_RELEASE;
+                }
+            }
+            else
+            {
+                s->down = 1;
+                s->event = TOUCH_PRESS;
+            }
+            break;
+        case ABS_MT_POSITION_X:
+        case ABS_MT_POSITION_Y:
+            d->frame_raw[d->frame_slot][data->code == ABS_MT_POSITION_Y] = data->value;
+            s->x = _axis_map(&d->axis[0], d->frame_raw[d->frame_slot]); // 旋转后x,y可能都跟着变
+            s->y = _axis_map(&d->axis[1], d->frame_raw[d->frame_slot]);
+            break;
+        default:
+            return 0;
+        }
+        if (s->event == TOUCH_NO_EVENT && s->down)
+        {
+            s->event = TOUCH_MOVE;
+        }
+        if (s->event != TOUCH_NO_EVENT)
+        {
+            s->time = time;
+            d->frame_state.changed |= 1 << d->frame_slot;
+        }
+        break;
+    case EV_SYN:
+        if (data->code == SYN_REPORT && d->frame_state.changed != 0)
+        {
+            d->frame_state.time = time;
+            fb_latency_input(time);
+            return 1;
+        }
+        break;
+    }
+    return 0;
+}
+
+int touch_read_frame(int touch_fd, touch_frame *frames, int max_frames)
+{
+    int num = 0;
+    touch_dev *d = _dev_check(touch_fd, "touch_read_frame");
+    if (d == NULL)
+    {
+        return -1;
+    }
+    while (num < max_frames)
+    {
+        if (d->frame_buf_pos == d->frame_buf_num)
+        {
+            if (num > 0 && d->frame_buf_num < TOUCH_READ_EVENTS)
+            {
+                break; // 上次没读满, 说明已经读空了, 省掉一次read
+            }
+            int n = _touch_fill(touch_fd, d->frame_buf, TOUCH_READ_EVENTS);
+            if (n < 0 && errno == EAGAIN)
+            {
+                d->frame_buf_pos = d->frame_buf_num = 0;
+                break;
+            }
+            if (n <= 0 || n % sizeof(struct input_event) != 0)
+            {
+                if (n == 0)
+                {
+                    printf("touch_read_frame: end of input\n"); // 设备拔掉或回放结束
+                }
+                else
+                {
+                    printf("touch_read_frame error %d, errno=%d\n", n, errno);
+                }
+                d->frame_buf_pos = d->frame_buf_num = 0;
+                return -1;
+            }
+            d->frame_buf_pos = 0;
+            d->frame_buf_num = n / sizeof(struct input_event);
+        }
+        struct input_event *e = &d->frame_buf[d->frame_buf_pos++];
+        if (e->type == EV_SYN && e->code == SYN_DROPPED)
+        {
+            d->frame_dropping = 1;
+            continue;
+        }
+        if (d->frame_dropping) // 丢弃到下一个SYN_REPORT, 然后换成读回的当前状态
+        {
+            if (e->type != EV_SYN || e->code != SYN_REPORT)
+            {
+                continue;
+            }
+            struct input_event sync[RESYNC_EVENTS_MAX];
+            int down[FINGER_NUM_MAX];
+            for (int i = 0; i < FINGER_NUM_MAX; i++)
+            {
+                down[i] = d->frame_state.slot[i].down;
+            }
+            int ns = _resync_events(touch_fd, d->clock_offset, down, sync);
+            d->frame_dropping = 0;
+            for (int i = 0; i < ns - 1; i++)
+            {
+                _frame_event(d, &sync[i]);
+            }
+            e = (ns > 0) ? &sync[ns - 1] : e;
+        }
+        if (_frame_event(d, e))
+        {
+            frames[num++] = d->frame_state;
+            d->frame_state.changed = 0;
+            for (int i = 0; i < FINGER_NUM_MAX; i++)
+            {
+                d->frame_state.slot[i].event = TOUCH_NO_EVENT;
+            }
+        }
+    }
+    return num;
+}
+
+/*============================ 合并模式 ============================*/
+
+/*b能否合并进a: 只有连续的移动能合并, 按下和松开必须单独交给应用*/
+static int _can_merge(const touch_frame *a, const touch_frame *b)
+{
+    for (int i = 0; i < FINGER_NUM_MAX; i++)
+    {
+        if ((b->changed & a->changed & (1 << i)) &&
+            (a->slot[i].event != TOUCH_MOVE || b->slot[i].event != TOUCH_MOVE))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void _path_add(touch_path *path, int x, int y, long long time)
+{
+    if ((path->num > 0) && ((path->total - 1) % path->stride != 0))
+    {
+        path->num--; // 上一点不在间隔上, 只是临时放着的最新位置
+    }
+    if (path->num == TOUCH_PATH_MAX) // 满了就隔一个丢一个, 间隔加倍, 整条轨迹均匀变稀
+    {
+        path->stride *= 2;
+        for (int i = 0; i < TOUCH_PATH_MAX / 2; i++)
+        {
+            path->pt[i] = path->pt[2 * i];
+        }
+        path->num = TOUCH_PATH_MAX / 2;
+    }
+    path->pt[path->num].x = x;
+    path->pt[path->num].y = y;
+    path->pt[path->num].time = time;
+    path->num++;
+    path->total++;
+}
+
+int touch_read_coalesced(int touch_fd, touch_frame *frame, touch_path *paths)
+{
+    touch_frame next;
+    int num = 0;
+    touch_dev *d = _dev_check(touch_fd, "touch_read_coalesced");
+    if (d == NULL)
+    {
+        return -1;
+    }
+    if (paths != NULL)
+    {
+        for (int i = 0; i < FINGER_NUM_MAX; i++)
+        {
+            paths[i].num = 0;
+            paths[i].total = 0;
+            paths[i].stride = 1;
+        }
+    }
+    for (;;)
+    {
+        if (d->held_valid)
+        {
+            next = d->held_frame;
+            d->held_valid = 0;
+        }
+        else
+        {
+            int n = touch_read_frame(touch_fd, &next, 1);
+            if (n < 0)
+            {
+                return -1;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+        }
+        if (num == 0)
+        {
+            *frame = next;
+        }
+        else if (_can_merge(frame, &next))
+        {
+            for (int i = 0; i < FINGER_NUM_MAX; i++)
+            {
+                if (next.changed & (1 << i))
+                {
+                    frame->slot[i] = next.slot[i];
+                }
+            }
+            frame->changed |= next.changed;
+            frame->time = next.time;
+        }
+        else
+        {
+            d->held_frame = next;
+            d->held_valid = 1;
+            break;
+        }
+        num = 1;
+        for (int i = 0; (paths != NULL) && (i < FINGER_NUM_MAX); i++)
+        {
+            if (next.changed & (1 << i))
+            {
+                _path_add(&paths[i], next.slot[i].x, next.slot[i].y, next.time);
+            }
+        }
+    }
+    return num;
+}
+
+/*============================ 笔迹滤波 ============================*/
+
+/*一阶低通的系数, dt是秒*/
+static float _smoothing(float cutoff, float dt)
+{
+    float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+    return 1.0f / (1.0f + tau / dt);
+}
+
+void touch_filter_init(touch_filter *f, const touch_filter_param *param)
+{
+    static const touch_filter_param def = {1.0f, 0.05f, 5.0f, 16, 1}; // 屏幕像素坐标下调出来的
+    memset(f, 0, sizeof(*f));
+    f->param = (param != NULL) ? *param : def;
+}
+
+void touch_filter_reset(touch_filter *f, int finger)
+{
+    if (finger >= 0 && finger < FINGER_NUM_MAX)
+    {
+        f->finger[finger].valid = 0;
+    }
+}
+
+void touch_filter_point(touch_filter *f, int finger, int *x, int *y, long long time)
+{
+    if (finger < 0 || finger >= FINGER_NUM_MAX)
+    {
+        return;
+    }
+    touch_filter_finger *s = &f->finger[finger];
+    if (!s->valid)
+    {
+        s->valid = 1;
+        s->time = time;
+        s->x = *x;
+        s->y = *y;
+        s->vx = s->vy = s->ax = s->ay = 0;
+        return;
+    }
+    float dt = (time - s->time) / 1000000.0f;
+    if (dt <= 0)
+    {
+        dt = 0.001f; // 同一帧里合并掉的点没有各自的时间, 当作1ms
+    }
+    s->time = time;
+    /*速度先低通, 再用它决定位置的截止频率; 预测也用这个速度和它的变化率*/
+    float ad = _smoothing(f->param.d_cutoff, dt);
+    float vx = s->vx + ad * ((*x - s->x) / dt - s->vx);
+    float vy = s->vy + ad * ((*y - s->y) / dt - s->vy);
+    float speed = sqrtf(vx * vx + vy * vy);
+    float a = _smoothing(f->param.min_cutoff + f->param.beta * speed, dt);
+    float nx = s->x + a * (*x - s->x);
+    float ny = s->y + a * (*y - s->y);
+    s->ax += ad * ((vx - s->vx) / dt - s->ax);
+    s->ay += ad * ((vy - s->vy) / dt - s->ay);
+    s->vx = vx;
+    s->vy = vy;
+    s->x = nx;
+    s->y = ny;
+    *x = (int)lrintf(nx);
+    *y = (int)lrintf(ny);
+}
+
+int touch_filter_predict(const touch_filter *f, int finger, int *x, int *y)
+{
+    if (finger < 0 || finger >= FINGER_NUM_MAX || !f->finger[finger].valid)
+    {
+        return -1;
+    }
+    const touch_filter_finger *s = &f->finger[finger];
+    float t = f->param.predict_ms / 1000.0f;
+    float px = s->x + s->vx * t;
+    float py = s->y + s->vy * t;
+    if (f->param.predict_order >= 2)
+    {
+        px += 0.5f * s->ax * t * t;
+        py += 0.5f * s->ay * t * t;
+    }
+    px = (px < 0) ? 0 : (px > SCREEN_WIDTH - 1) ? SCREEN_WIDTH - 1 : px;
+    py = (py < 0) ? 0 : (py > SCREEN_HEIGHT - 1) ? SCREEN_HEIGHT - 1 : py;
+    *x = (int)lrintf(px);
+    *y = (int)lrintf(py);
+    return 0;
+}
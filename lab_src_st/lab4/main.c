@@ -6,6 +6,7 @@
 #define COLOR_TEXT FB_COLOR(0xff, 0xff, 0xff)
 #define COLOR_GREY FB_COLOR(0x54, 0x54, 0x54)
 #define BAR_H 60
+#define GRID 40 // 网格间距
 #define ERASER_X 10
 #define ERASER_Y 10
 #define ERASER_W 40
@@ -14,32 +15,139 @@
 #define CROSS_Y 10
 #define CROSS_W 40
 #define CROSS_H 40
+#define UNDO_X 60
+#define REDO_X 110
+#define UNDO_Y 10
+#define UNDO_W 40
+#define UNDO_H 40
+#define HISTORY_BYTES (4 << 20) // 撤销历史最多占用的内存
+#define STROKE_R 4.5f // 笔迹半宽, 抗锯齿后边缘再往外半个像素
+#define DOT_R 2.5f
 static int color_finger[5] = {FB_COLOR(0xff, 0x00, 0x04), FB_COLOR(0xae, 0x00, 0xff),
 							 FB_COLOR(0xff, 0xe1, 0x00), FB_COLOR(0x26, 0xff, 0x00), FB_COLOR(0x00, 0xff, 0xd5)};
 static int touch_fd;
 static fb_image *eraser_img;
 static fb_image *cross_img;
+static fb_layer *grid_layer;	// 背景网格, 开始时合成一次, 之后由画布恢复
+static fb_layer *toolbar_layer;
 static int move_num = 3;
 static int old_x[5], old_y[5];
-void draw_ui() // draw clear button, background and refresh screen
+static touch_filter filter;		// 去抖并预测手指位置
+static fb_image *predict_save;	// 预测线段下面原来的像素, 下一帧先恢复
+static int predict_x, predict_y;
+static int erased;				// 这一轮按了橡皮, 不画预测
+static fb_canvas *canvas;		// 笔迹的撤销历史, 画笔迹前先说明要改的区域
+static fb_aa_cover *cover;		// 同一笔的线段在连接处只混合一次
+static int stroke_id[5];		// 每个手指当前这一笔的笔号
+static void draw_arrow(fb_ctx *ctx, int x, int y, int dir) // 工具栏上的撤销(dir=-1)/重做(dir=1)按钮
 {
-	fb_draw_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, COLOR_BACKGROUND);
-	for (int i = 0; i < SCREEN_WIDTH; i += 40)
+	int cx = x + UNDO_W / 2, cy = y + UNDO_H / 2;
+	int tip = cx + dir * 12;
+	fb_ctx_draw_aa_line(ctx, cx - dir * 12, cy, tip, cy, 2.0f, COLOR_GREY);
+	fb_ctx_draw_aa_line(ctx, tip, cy, tip - dir * 9, cy - 9, 2.0f, COLOR_GREY);
+	fb_ctx_draw_aa_line(ctx, tip, cy, tip - dir * 9, cy + 9, 2.0f, COLOR_GREY);
+}
+void init_ui() // 背景网格和工具栏各画进一个图层, 只画一次
+{
+	fb_ctx ctx;
+	grid_layer = fb_layer_new("grid", SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+	fb_image *cell = fb_new_image(FB_COLOR_RGB_8880, GRID, GRID, 0); // 一格: 上边和左边是网格线, 平铺成整个网格
+	if (cell != NULL)
+	{
+		fb_ctx_init(&ctx, cell);
+		fb_ctx_draw_rect(&ctx, 0, 0, GRID, GRID, COLOR_BACKGROUND);
+		fb_ctx_draw_straight_line(&ctx, 0, 0, GRID, 0, COLOR_GREY);
+		fb_ctx_draw_straight_line(&ctx, 0, 0, GRID, 1, COLOR_GREY);
+		fb_ctx_init(&ctx, fb_layer_image(grid_layer));
+		fb_ctx_fill_pattern(&ctx, NULL, cell);
+		fb_layer_damage(grid_layer, NULL);
+		fb_free_image(cell);
+	}
+	toolbar_layer = fb_layer_new("toolbar", SCREEN_WIDTH, BAR_H, 1);
+	fb_layer_fill_rect(toolbar_layer, 0, 0, SCREEN_WIDTH, BAR_H, COLOR_BAR);
+	fb_layer_draw_image(toolbar_layer, ERASER_X, ERASER_Y, eraser_img, 0);
+	fb_layer_draw_image(toolbar_layer, CROSS_X, CROSS_Y, cross_img, 0);
+	fb_ctx_init(&ctx, fb_layer_image(toolbar_layer));
+	draw_arrow(&ctx, UNDO_X, UNDO_Y, -1);
+	draw_arrow(&ctx, REDO_X, UNDO_Y, 1);
+	fb_layer_damage(toolbar_layer, NULL);
+}
+void draw_ui() // 清除笔迹: 画过的块恢复成最初的网格, 可以撤销
+{
+	fb_free_image(predict_save); // 网格会盖住预测线段, 不用再恢复
+	predict_save = NULL;
+	fb_canvas_revert(canvas);
+	erased = 1;
+}
+static void draw_stroke(int x1, int y1, int x2, int y2, float r, int finger) // 先记下要改的块再画
+{
+	int m = (int)r + 2; // 抗锯齿的边缘再多半个像素
+	int x = (x1 < x2) ? x1 : x2, y = (y1 < y2) ? y1 : y2;
+	fb_canvas_modify(canvas, x - m, y - m, abs(x2 - x1) + 2 * m + 1, abs(y2 - y1) + 2 * m + 1);
+	fb_draw_aa_stroke(cover, stroke_id[finger], x1, y1, x2, y2, r, color_finger[finger]);
+}
+static void erase_prediction()
+{
+	if (predict_save == NULL)
 	{
-		fb_draw_straight_line(i, 0, SCREEN_HEIGHT, 1, COLOR_GREY);
+		return;
 	}
-	for (int j = 0; j < SCREEN_HEIGHT; j += 40)
+	fb_draw_image(predict_x, predict_y, predict_save, 0);
+	fb_free_image(predict_save);
+	predict_save = NULL;
+}
+static void draw_prediction(int down) // 从最后画到的点画到预测的位置, 先保存下面的像素
+{
+	int px[FINGER_NUM_MAX], py[FINGER_NUM_MAX], mask = 0;
+	int x1 = SCREEN_WIDTH, y1 = SCREEN_HEIGHT, x2 = 0, y2 = 0;
+	if (filter.param.predict_ms <= 0)
 	{
-		fb_draw_straight_line(0, j, SCREEN_WIDTH, 0, COLOR_GREY);
+		return;
+	}
+	for (int finger = 0; finger < FINGER_NUM_MAX; finger++)
+	{
+		if (!(down & (1 << finger)) || (old_y[finger] <= BAR_H) ||
+			(touch_filter_predict(&filter, finger, &px[finger], &py[finger]) < 0) || (py[finger] <= BAR_H))
+		{
+			continue;
+		}
+		mask |= 1 << finger;
+		x1 = (px[finger] < x1) ? px[finger] : x1;
+		x1 = (old_x[finger] < x1) ? old_x[finger] : x1;
+		y1 = (py[finger] < y1) ? py[finger] : y1;
+		y1 = (old_y[finger] < y1) ? old_y[finger] : y1;
+		x2 = (px[finger] > x2) ? px[finger] : x2;
+		x2 = (old_x[finger] > x2) ? old_x[finger] : x2;
+		y2 = (py[finger] > y2) ? py[finger] : y2;
+		y2 = (old_y[finger] > y2) ? old_y[finger] : y2;
+	}
+	if (mask == 0)
+	{
+		return;
+	}
+	x1 = (x1 - 5 < 0) ? 0 : x1 - 5; // STROKE_R加上抗锯齿的半个像素
+	y1 = (y1 - 5 < 0) ? 0 : y1 - 5;
+	x2 = (x2 + 6 > SCREEN_WIDTH) ? SCREEN_WIDTH : x2 + 6;
+	y2 = (y2 + 6 > SCREEN_HEIGHT) ? SCREEN_HEIGHT : y2 + 6;
+	fb_image *view = fb_get_sub_image(fb_screen_ctx()->target, x1, y1, x2 - x1, y2 - y1);
+	predict_save = (view != NULL) ? fb_copy_image(view) : NULL;
+	fb_free_image(view);
+	if (predict_save == NULL)
+	{
+		return;
+	}
+	predict_x = x1;
+	predict_y = y1;
+	for (int finger = 0; finger < FINGER_NUM_MAX; finger++)
+	{
+		if (mask & (1 << finger))
+		{
+			fb_draw_aa_line(old_x[finger], old_y[finger], px[finger], py[finger], STROKE_R, color_finger[finger]);
+		}
 	}
-	fb_draw_rect(0, 0, SCREEN_WIDTH, BAR_H, COLOR_BAR);
-	fb_draw_image(ERASER_X, ERASER_Y, eraser_img, 0);
-	fb_draw_image(CROSS_X, CROSS_Y, cross_img, 0);
 }
-static void touch_event_cb(int fd)
+static void touch_finger(int type, int x, int y, int finger)
 {
-	int type, x, y, finger;
-	type = touch_read(fd, &x, &y, &finger);
 	switch (type)
 	{
 	case TOUCH_PRESS:
@@ -48,59 +156,144 @@ static void touch_event_cb(int fd)
 		{
 			draw_ui();
 		}
+		else if ((x >= UNDO_X) && (x < UNDO_X + UNDO_W) && (y >= UNDO_Y) && (y < UNDO_Y + UNDO_H))
+		{
+			fb_canvas_undo(canvas);
+		}
+		else if ((x >= REDO_X) && (x < REDO_X + UNDO_W) && (y >= UNDO_Y) && (y < UNDO_Y + UNDO_H))
+		{
+			fb_canvas_redo(canvas);
+		}
 		else if ((x >= CROSS_X) && (x < CROSS_X + CROSS_W) && (y >= CROSS_Y) && (y < CROSS_Y + CROSS_H))
 		{
 			fb_draw_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, COLOR_BACKGROUND);
 			fb_update();
-			fb_free_image(cross_img);
-			fb_free_image(eraser_img);
+			fb_layer_free(toolbar_layer);
+			fb_layer_free(grid_layer);
+			fb_canvas_free(canvas);
+			fb_aa_cover_free(cover);
+			fb_image_release(cross_img);
+			fb_image_release(eraser_img);
 			exit(0);
 		}
 		else
 		{
-			fb_draw_round(x, y, 2, color_finger[finger]);
+			stroke_id[finger] = fb_aa_cover_begin(cover);
+			draw_stroke(x, y, x, y, DOT_R, finger);
 		}
 		break;
 	case TOUCH_MOVE:
 		if (y > BAR_H)
 		{
-			fb_draw_thick_line(old_x[finger], old_y[finger], x, y, 4, color_finger[finger]);
+			draw_stroke(old_x[finger], old_y[finger], x, y, STROKE_R, finger);
 		}
 		break;
 	case TOUCH_RELEASE:
 		// printf("TOUCH_RELEASE：x=%d,y=%d,finger=%d\n",x,y,finger);
 		break;
-	case TOUCH_ERROR:
-		printf("close touch fd\n");
-		close(fd);
-		task_delete_file(fd);
-		break;
 	default:
 		return;
 	}
 	old_x[finger] = x;
 	old_y[finger] = y;
+}
+static void touch_event_cb(int fd) // 积压的移动合并成一帧, 沿合并掉的轨迹点画完再刷新一次屏幕
+{
+	touch_frame frame;
+	touch_path paths[FINGER_NUM_MAX];
+	static int down = 0; // 最近一帧按着的手指, 没有新帧时也要接着画预测
+	int n;
+	erase_prediction();
+	erased = 0;
+	while ((n = touch_read_coalesced(fd, &frame, paths)) > 0)
+	{
+		down = 0;
+		for (int finger = 0; finger < FINGER_NUM_MAX; finger++)
+		{
+			if ((frame.changed & (1 << finger)) == 0)
+			{
+				continue;
+			}
+			touch_slot *s = &frame.slot[finger];
+			if (s->event == TOUCH_MOVE)
+			{
+				for (int i = 0; i < paths[finger].num; i++)
+				{
+					int x = paths[finger].pt[i].x, y = paths[finger].pt[i].y;
+					touch_filter_point(&filter, finger, &x, &y, paths[finger].pt[i].time);
+					touch_finger(TOUCH_MOVE, x, y, finger);
+				}
+			}
+			else
+			{
+				if (s->event == TOUCH_PRESS)
+				{
+					touch_filter_reset(&filter, finger);
+					touch_filter_point(&filter, finger, &s->x, &s->y, s->time);
+				}
+				touch_finger(s->event, s->x, s->y, finger);
+			}
+		}
+		for (int finger = 0; finger < FINGER_NUM_MAX; finger++)
+		{
+			down |= frame.slot[finger].down << finger;
+		}
+		if (down == 0)
+		{
+			fb_canvas_snapshot(canvas); // 手指都抬起来时一笔结束, 成为一步
+		}
+	}
+	if (n < 0)
+	{
+		printf("close touch fd\n");
+		task_delete_file(fd);
+		touch_close(fd);
+		return;
+	}
+	if (!erased)
+	{
+		draw_prediction(down);
+	}
 	fb_update();
 	return;
 }
 
 int main(int argc, char *argv[])
 {
+	fb_asset assets[] = {
+		{FB_ASSET_FONT, "/home/pi/font.ttc", 0, NULL},
+		{FB_ASSET_IMAGE, "/home/pi/cross40.png", FB_DECODE_PALETTE, NULL},
+		{FB_ASSET_IMAGE, "/home/pi/eraser40.png", FB_DECODE_PALETTE, NULL},
+	};
 	fb_init("/dev/fb0");
-	font_init("/home/pi/font.ttc");
-	cross_img = fb_read_png_image("/home/pi/cross40.png");
-	eraser_img = fb_read_png_image("/home/pi/eraser40.png");
-	fb_draw_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, COLOR_BACKGROUND);
-	draw_ui();
+	fb_image_cache_mount(fb_bundle_open("/home/pi/assets.fbb")); // mkbundle生成的预解码图标
+	fb_load_assets(assets, sizeof(assets) / sizeof(assets[0]), NULL);
+	cross_img = assets[1].image;
+	eraser_img = assets[2].image;
+	init_ui();
 	fb_update();
+	canvas = fb_canvas_new(fb_screen_ctx()->target, HISTORY_BYTES); // 网格合成以后才是最初的样子
+	cover = fb_aa_cover_new(fb_screen_ctx()->target);
+	touch_filter_init(&filter, NULL);
 
 	//打开多点触摸设备文件, 返回文件fd
 	touch_fd = touch_init("/dev/input/event0");
+	//在输入线程里读触摸事件, 画得慢时也不丢; 线程起不来就直接读touch_fd
+	int ring_fd = touch_thread_start(touch_fd);
+	if (ring_fd >= 0)
+	{
+		touch_fd = ring_fd;
+	}
 	//添加任务, 当touch_fd文件可读时, 会自动调用touch_event_cb函数
 	task_add_file(touch_fd, touch_event_cb);
 
 	task_loop(); //进入任务循环
-	fb_free_image(eraser_img);
-	fb_free_image(cross_img);
+	fb_latency_print(); // 触摸设备断开(例如回放结束)后才会走到这里
+	fb_layer_free(toolbar_layer);
+	fb_layer_free(grid_layer);
+	fb_canvas_free(canvas);
+	fb_aa_cover_free(cover);
+	fb_image_release(eraser_img);
+	fb_image_release(cross_img);
 	return 0;
 }
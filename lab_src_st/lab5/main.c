@@ -33,7 +33,7 @@ static void touch_event_cb(int fd)
 	case TOUCH_ERROR:
 		printf("close touch fd\n");
 		task_delete_file(fd);
-		close(fd);
+		touch_close(fd);
 		break;
 	default:
 		return;
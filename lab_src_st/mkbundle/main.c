@@ -0,0 +1,140 @@
+/* 把资源目录(含子目录)下的png/jpg图片预先解码, 打包成一个可以mmap的bundle文件
+ * 用法: mkbundle [-c] [-r root] <asset_dir> <out.fbb>
+ *   -c: 紧凑格式, 不超过256色的图片存成调色板, jpg存成RGB565
+ *   -r: 运行时资源所在的目录, 默认就是asset_dir; 图片按root/相对路径匹配 */
+
+#include <stdio.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "../common/common.h"
+
+#define ASSET_NUM_MAX	256
+
+static char *names[ASSET_NUM_MAX];
+static int name_num;
+
+static int is_image_name(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	if(ext == NULL) return 0;
+	return (strcasecmp(ext, ".png") == 0)||
+		(strcasecmp(ext, ".jpg") == 0)||
+		(strcasecmp(ext, ".jpeg") == 0);
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+/*收集dir/rel下的图片, 名字是相对dir的路径*/
+static int scan_dir(const char *dir, const char *rel)
+{
+	char path[512], sub[512];
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+
+	if(snprintf(path, sizeof(path), "%s%s%s", dir, rel[0] ? "/" : "", rel) >= (int)sizeof(path)) {
+		fprintf(stderr, "path too long: %s/%s\n", dir, rel);
+		return -1;
+	}
+	d = opendir(path);
+	if(d == NULL) {
+		fprintf(stderr, "open dir %s error(%d): %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	while((ent = readdir(d)) != NULL)
+	{
+		if(ent->d_name[0] == '.') continue;
+		if((snprintf(sub, sizeof(sub), "%s%s%s", rel, rel[0] ? "/" : "", ent->d_name) >= (int)sizeof(sub))||
+			(snprintf(path, sizeof(path), "%s/%s", dir, sub) >= (int)sizeof(path))) {
+			fprintf(stderr, "path too long, skip: %s/%s\n", rel, ent->d_name);
+			continue;
+		}
+		if((stat(path, &st) == 0)&&S_ISDIR(st.st_mode)) {
+			if(scan_dir(dir, sub) < 0) break;
+			continue;
+		}
+		if(!is_image_name(ent->d_name)) continue;
+		if(name_num == ASSET_NUM_MAX) {
+			fprintf(stderr, "too many assets, max %d\n", ASSET_NUM_MAX);
+			break;
+		}
+		names[name_num++] = strdup(sub);
+	}
+	closedir(d);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	fb_image *images[ASSET_NUM_MAX];
+	long long mtimes[ASSET_NUM_MAX];
+	char path[512];
+	struct stat st;
+	char *root = NULL;
+	int i, n, bytes = 0;
+	int compact = 0;
+
+	while(argc > 1)
+	{
+		if(strcmp(argv[1], "-c") == 0) {
+			compact = 1;
+		} else if((strcmp(argv[1], "-r") == 0)&&(argc > 2)) {
+			root = argv[2];
+			argc--;
+			argv++;
+		} else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+	if(argc < 3) {
+		fprintf(stderr, "usage: mkbundle [-c] [-r root] <asset_dir> <out.fbb>\n");
+		return 1;
+	}
+	if(root == NULL) root = argv[1];
+	if(scan_dir(argv[1], "") < 0) return 1;
+	n = name_num;
+	qsort(names, n, sizeof(char *), cmp_name);
+
+	for(i=0; i<n; ++i)
+	{
+		if(snprintf(path, sizeof(path), "%s/%s", argv[1], names[i]) >= (int)sizeof(path)) {
+			fprintf(stderr, "path too long: %s/%s\n", argv[1], names[i]);
+			return 1;
+		}
+		mtimes[i] = 0;
+		if(stat(path, &st) == 0)
+			mtimes[i] = st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+		images[i] = fb_load_image(path, compact ? FB_DECODE_PALETTE : FB_DECODE_DEFAULT);
+		if(images[i] == NULL) {
+			fprintf(stderr, "decode %s failed\n", path);
+			return 1;
+		}
+		if(compact && (images[i]->color_type == FB_COLOR_RGB_8880)) {
+			fb_image *img = fb_convert_image(images[i], FB_COLOR_RGB_565);
+			if(img != NULL) {
+				fb_free_image(images[i]);
+				images[i] = img;
+			}
+		}
+		bytes += images[i]->line_byte * images[i]->pixel_h;
+		printf("%-32s %4dx%-4d type %d\n", names[i], images[i]->pixel_w, images[i]->pixel_h, images[i]->color_type);
+	}
+
+	if(fb_bundle_write(argv[2], root, names, images, mtimes, n) < 0) {
+		remove(argv[2]); /*不留下不完整的bundle*/
+		return 1;
+	}
+	printf("%d images, %d bytes -> %s\n", n, bytes, argv[2]);
+
+	for(i=0; i<n; ++i) {
+		fb_free_image(images[i]);
+		free(names[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,69 @@
+/* 把触摸设备上报的原始input_event(带时间戳)录进文件, 供touch_init回放
+ * 用法: touchrec <touch_dev> <out_file> [seconds]
+ *   没给seconds时录到Ctrl+C为止. 录像里是本机的struct input_event,
+ *   只能在同样字长的机器上回放 */
+
+#include <stdio.h>
+#include <signal.h>
+#include "../common/common.h"
+#include "input.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct input_event buf[TOUCH_READ_EVENTS];
+	struct sigaction sa;
+	int in, out, n, events = 0, frames = 0;
+
+	if(argc < 3) {
+		fprintf(stderr, "usage: touchrec <touch_dev> <out_file> [seconds]\n");
+		return 1;
+	}
+	in = open(argv[1], O_RDONLY);
+	if(in < 0) {
+		fprintf(stderr, "open %s error(%d): %s\n", argv[1], errno, strerror(errno));
+		return 1;
+	}
+	out = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(out < 0) {
+		fprintf(stderr, "open %s error(%d): %s\n", argv[2], errno, strerror(errno));
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal; /*不设SA_RESTART, 让阻塞的read被打断*/
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGALRM, &sa, NULL);
+	if(argc > 3) alarm(atoi(argv[3]));
+	printf("recording %s -> %s\n", argv[1], argv[2]);
+
+	while(!stop)
+	{
+		n = read(in, buf, sizeof(buf));
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "read %s error(%d): %s\n", argv[1], errno, strerror(errno));
+			break;
+		}
+		if(n == 0) break;
+		if(write(out, buf, n) != n) {
+			fprintf(stderr, "write %s error(%d): %s\n", argv[2], errno, strerror(errno));
+			break;
+		}
+		for(int i=0; i<n/(int)sizeof(buf[0]); ++i)
+			if((buf[i].type == EV_SYN) && (buf[i].code == SYN_REPORT)) frames++;
+		events += n/sizeof(buf[0]);
+	}
+	close(out);
+	close(in);
+	printf("%d events, %d frames\n", events, frames);
+	return 0;
+}